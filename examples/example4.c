@@ -55,8 +55,9 @@ mvl_add_directory_entry(ctx, mvl_write_string(ctx, -1, "example4.c", LIBMVL_NO_M
 
 mvl_add_directory_entry(ctx, MVL_WVEC(ctx, LIBMVL_VECTOR_INT32, 1, 2, 3, 5, 7, 11, 13, 17), "primes");
 
-/* Now memory map written out data and compute checksums */
+/* Now memory map written out data and compute checksums. Data still held in the write buffer, if it was enabled with mvl_set_write_buffer_size(), has to be written out first */
 
+mvl_flush_write_buffer(ctx);
 fflush(fout);
 length=ftell(fout);
 
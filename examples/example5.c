@@ -1,42 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include "libMVL.h"
 
 char *data;
 
 int main(int argc, char *argv[])
 {
-FILE *fin;
 long i;
 LIBMVL_CONTEXT *ctx;
 LIBMVL_NAMED_LIST *L;
-LIBMVL_OFFSET64 length, offset_ad, offset_ac, offset_checksums;
+LIBMVL_OFFSET64 offset_ad, offset_ac, offset_checksums;
 LIBMVL_VECTOR *vec_ad, *vec_ac;
 
 
-fin=fopen("test4.mvl", "r");
-if(fin==NULL) {
-	perror("test4.mvl");
-	exit(-1);
-	}
-	
-fseek(fin, 0, SEEK_END);
-length=ftell(fin);
-fseek(fin, 0, SEEK_SET);
-
-data=mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(fin), 0);
-if(data==MAP_FAILED) {
-	perror("Memory mapping test4.mvl");
-	exit(-1);
-	}
-	
-/* We don't need the handle anymore, free up the file descriptor */
-fclose(fin);
-fin=NULL;
-
 ctx=mvl_create_context();
-mvl_load_image(ctx, data, length);
+/* The context owns the memory map, which is released by mvl_free_context() */
+mvl_open_mapped(ctx, "test4.mvl", LIBMVL_MAP_RANDOM);
+data=(char *)ctx->data;
 	
 if(mvl_verify_full_checksum_vector(ctx, NULL, NULL, 0)) {
 	fprintf(stderr, "Error verifying full checksums: %s\n", mvl_strerror(ctx));
@@ -50,6 +30,8 @@ if(offset_ad==LIBMVL_NULL_OFFSET) {
 	fprintf(stderr, "Could not find data frame member ad\n");
 	exit(-1);
 	}
+/* Start loading the column in the background */
+mvl_advise_vector(ctx, offset_ad, LIBMVL_ADVISE_WILLNEED);
 
 /* Example how to verify single vector, if the file is too large to verify fully */
 if(mvl_verify_checksum_vector2(ctx, NULL, NULL, 0, offset_ad)) {
@@ -85,7 +67,5 @@ fflush(stdout);
 mvl_free_named_list(L);
 mvl_free_context(ctx);
 
-munmap(data, length);
-
 exit(0);
 }
@@ -5,17 +5,38 @@
  *   @brief core libMVL functions
  */
 
+#ifndef _GNU_SOURCE
+/* Needed for O_DIRECT */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifndef __WIN32__
 #include <alloca.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #else
 #include <malloc.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* OpenMP directives expand to nothing when compiling without OpenMP support */
+#ifdef _OPENMP
+#define MVL_OMP(...)	_Pragma(#__VA_ARGS__)
+#else
+#define MVL_OMP(...)
+#endif
 
 #ifdef RMVL_PACKAGE
 #include <R.h>
@@ -61,6 +82,16 @@ while(r==NULL){
 return r;
 }
 
+static inline int mvl_max_threads(void)
+{
+#ifdef _OPENMP
+if(omp_in_parallel())return 1;
+return(omp_get_max_threads());
+#else
+return 1;
+#endif
+}
+
 static inline char *memndup(const char *s, LIBMVL_OFFSET64 len)
 {
 char *p;
@@ -158,6 +189,11 @@ return(0);
 }
 
 
+/* Default size of the write buffer allocated by mvl_open(). Buffering is off by default, so that data written so far can be read back from the FILE */
+#ifndef LIBMVL_WRITE_BUFFER_SIZE
+#define LIBMVL_WRITE_BUFFER_SIZE	0
+#endif
+
 /*!  @brief Create MVL context 
  * 
  *   @return A pointer to allocated LIBMVL_CONTEXT structure
@@ -181,11 +217,16 @@ mvl_recompute_named_list_hash(ctx->directory);
 ctx->directory_offset=-1;
 
 ctx->full_checksums_offset=LIBMVL_NULL_OFFSET;
+ctx->checksum_algorithm=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64;
 
 ctx->character_class_offset=0;
 
 ctx->cached_strings=mvl_create_named_list(32);
 
+/* The buffer is allocated when the context is used for writing */
+ctx->write_buffer=NULL;
+ctx->write_buffer_size=LIBMVL_WRITE_BUFFER_SIZE;
+
 ctx->flags=0;
 
 #ifdef HAVE_POSIX_FALLOCATE
@@ -209,6 +250,14 @@ mvl_free_named_list(ctx->directory);
 // 	free(ctx->directory[i].tag);
 // free(ctx->directory);
 mvl_free_named_list(ctx->cached_strings);
+free(ctx->write_buffer);
+free(ctx->direct_write_buffer);
+free(ctx->verified_blocks);
+free(ctx->stream_block);
+free(ctx->stream_hashes);
+#ifndef __WIN32__
+if(ctx->mapping!=NULL)munmap(ctx->mapping, ctx->mapping_length);
+#endif
 free(ctx);
 }
 
@@ -286,35 +335,346 @@ switch(ctx->error) {
 		return("data is NULL and mvl_load_image() has not been called on MVL context");
 	case LIBMVL_ERR_MVL_FILE_TOO_SHORT:
 		return("MVL file length is too short, indicating a corrupt or wrong file");
+	case LIBMVL_ERR_CANNOT_OPEN:
+		return("could not open file");
+	case LIBMVL_ERR_CANNOT_MAP:
+		return("could not memory map file");
+	case LIBMVL_ERR_CHECKSUMS_INVALIDATED:
+		return("data covered by streaming checksums was modified out of order");
 	default:
 		return("unknown error");
 	
 	}
 }
 
+/*! @brief Write out data accumulated in the write buffer. This is done automatically by mvl_close() and is only needed when accessing the underlying FILE directly.
+ *   @param ctx MVL context pointer that has been initialized for writing
+ */
+void mvl_flush_write_buffer(LIBMVL_CONTEXT *ctx)
+{
+LIBMVL_OFFSET64 n;
+if(ctx->write_buffer_used<1)return;
+n=fwrite(ctx->write_buffer, 1, ctx->write_buffer_used, ctx->f);
+if(n<ctx->write_buffer_used)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
+ctx->write_buffer_used=0;
+}
+
+/*! @brief Set size of the buffer used to combine small writes. Offsets of written vectors are tracked by the context, rather than queried from the operating system.
+ *   Buffering is disabled by default. When it is enabled call mvl_flush_write_buffer() before reading data back from the file, for example to compute checksums with mvl_write_hash64_checksum_vector().
+ *   @param ctx MVL context pointer
+ *   @param size buffer size in bytes, 0 disables buffering
+ */
+void mvl_set_write_buffer_size(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 size)
+{
+if(ctx->f!=NULL)mvl_flush_write_buffer(ctx);
+free(ctx->write_buffer);
+ctx->write_buffer=NULL;
+ctx->write_buffer_size=size;
+ctx->write_buffer_used=0;
+if(size>0)ctx->write_buffer=do_malloc(size, 1);
+}
+
+/* Direct writes are done in blocks aligned to LIBMVL_DIRECT_WRITE_ALIGNMENT bytes, passing through a bounce buffer of LIBMVL_DIRECT_WRITE_CHUNK bytes when data is not aligned in memory */
+#ifndef LIBMVL_DIRECT_WRITE_ALIGNMENT
+#define LIBMVL_DIRECT_WRITE_ALIGNMENT	4096
+#endif
+
+#ifndef LIBMVL_DIRECT_WRITE_CHUNK
+#define LIBMVL_DIRECT_WRITE_CHUNK	(1<<22)
+#endif
+
+/*! @brief Write large vectors bypassing the page cache. This keeps large dumps from evicting data used by other programs, such as readers of memory mapped MVL files.
+ *   Data of at least threshold bytes passed to mvl_write_vector(), mvl_start_write_vector() or mvl_rewrite_vector() is written with O_DIRECT in blocks aligned to LIBMVL_DIRECT_WRITE_ALIGNMENT bytes. 
+ *   Partial blocks at either end go through the page cache as usual. If the file system does not support O_DIRECT, ordinary pwrite() calls are used instead. The file contents are the same in either case.
+ *
+ *   This is only supported on systems with pwrite() and is ignored elsewhere.
+ *   @param ctx MVL context pointer
+ *   @param threshold minimum size of data in bytes to write directly, 0 disables direct writes
+ */
+void mvl_set_direct_write_threshold(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 threshold)
+{
+ctx->direct_write_threshold=threshold;
+}
+
+#ifndef __WIN32__
+/* Write data at given file offset bypassing the stdio buffer. The caller must flush any pending data first */
+static int mvl_write_direct(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_OFFSET64 length, const unsigned char *data)
+{
+LIBMVL_OFFSET64 head, body, k, n;
+const unsigned char *src;
+ssize_t res;
+int fd, fl, direct;
+
+fd=fileno(ctx->f);
+
+/* Unaligned head and tail go through page cache */
+head=(LIBMVL_DIRECT_WRITE_ALIGNMENT-(offset % LIBMVL_DIRECT_WRITE_ALIGNMENT)) % LIBMVL_DIRECT_WRITE_ALIGNMENT;
+if(head>length)head=length;
+body=((length-head)/LIBMVL_DIRECT_WRITE_ALIGNMENT)*LIBMVL_DIRECT_WRITE_ALIGNMENT;
+
+if(head>0 && pwrite(fd, data, head, offset)!=head)return(LIBMVL_ERR_INCOMPLETE_WRITE);
+if(length>head+body && pwrite(fd, &(data[head+body]), length-head-body, offset+head+body)!=length-head-body)return(LIBMVL_ERR_INCOMPLETE_WRITE);
+if(body<1)return(0);
+
+direct=0;
+fl=fcntl(fd, F_GETFL);
+#ifdef O_DIRECT
+if(fl>=0 && fcntl(fd, F_SETFL, fl | O_DIRECT)>=0)direct=1;
+#endif
+
+if(direct && ctx->direct_write_buffer==NULL) {
+	if(posix_memalign((void **)&(ctx->direct_write_buffer), LIBMVL_DIRECT_WRITE_ALIGNMENT, LIBMVL_DIRECT_WRITE_CHUNK))ctx->direct_write_buffer=NULL;
+	}
+
+for(k=0;k<body;k+=n) {
+	n=body-k;
+	if(n>LIBMVL_DIRECT_WRITE_CHUNK)n=LIBMVL_DIRECT_WRITE_CHUNK;
+	src=&(data[head+k]);
+	if(direct && (((size_t)src) % LIBMVL_DIRECT_WRITE_ALIGNMENT)) {
+		if(ctx->direct_write_buffer!=NULL) {
+			memcpy(ctx->direct_write_buffer, src, n);
+			src=ctx->direct_write_buffer;
+			}
+		}
+	res=pwrite(fd, src, n, offset+head+k);
+	if(res<0 && direct) {
+		/* The file system does not accept direct writes, fall back to page cache */
+		fcntl(fd, F_SETFL, fl);
+		direct=0;
+		res=pwrite(fd, &(data[head+k]), n, offset+head+k);
+		}
+	if(res!=n) {
+		if(direct)fcntl(fd, F_SETFL, fl);
+		return(LIBMVL_ERR_INCOMPLETE_WRITE);
+		}
+	}
+if(direct)fcntl(fd, F_SETFL, fl);
+return(0);
+}
+#endif
+
+/* Make sure array p with count valid elements can hold at least min_size elements */
+static LIBMVL_OFFSET64 *mvl_grow_offsets(LIBMVL_OFFSET64 *p, LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *size, LIBMVL_OFFSET64 min_size)
+{
+LIBMVL_OFFSET64 *p2;
+if(min_size<=*size)return(p);
+*size=2*(*size)+min_size;
+p2=do_malloc(*size, sizeof(*p2));
+if(count>0)memcpy(p2, p, count*sizeof(*p2));
+free(p);
+return(p2);
+}
+
+/* Checksums are computed by several threads in chunks of LIBMVL_CHECKSUM_CHUNK blocks when a chunk of output covers at least LIBMVL_PARALLEL_CHECKSUM_THRESHOLD bytes */
+#ifndef LIBMVL_CHECKSUM_CHUNK
+#define LIBMVL_CHECKSUM_CHUNK	64
+#endif
+
+#ifndef LIBMVL_PARALLEL_CHECKSUM_THRESHOLD
+#define LIBMVL_PARALLEL_CHECKSUM_THRESHOLD	(1LLU<<22)
+#endif
+
+/* Compute checksum of a single block */
+static inline LIBMVL_OFFSET64 mvl_hash64_checksum_block(int checksum_algorithm, const unsigned char *data8, LIBMVL_OFFSET64 block, LIBMVL_OFFSET64 block_stop)
+{
+LIBMVL_OFFSET64 hash;
+
+hash=MVL_SEED_HASH_VALUE;
+if(checksum_algorithm==LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64)
+	hash=mvl_accumulate_int64_hash64w(hash, (const long long *)&(data8[block]), (block_stop-block)>>3);
+	else
+	hash=mvl_accumulate_int64_hash64(hash, (const long long *)&(data8[block]), (block_stop-block)>>3);
+return(mvl_randomize_bits64(hash));
+}
+
+/* Compute checksums of count blocks starting with block first. Runs of 8 full blocks are hashed together when the algorithm does not interleave words of a single block */
+static void mvl_hash64_checksum_blocks(int checksum_algorithm, const unsigned char *data8, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size, 
+				       LIBMVL_OFFSET64 first, LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *hash)
+{
+LIBMVL_OFFSET64 i, k, block, block_stop;
+const long long *p;
+
+i=0;
+if(checksum_algorithm==LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64) {
+	for(i=0;i+8<=count;i+=8) {
+		block=checksum_area_start+(first+i)*checksum_block_size;
+		if(block+8*checksum_block_size>checksum_area_stop)break;
+		
+		p=(const long long *)&(data8[block]);
+		for(k=0;k<8;k++)hash[i+k]=MVL_SEED_HASH_VALUE;
+		mvl_accumulate_int64_hash64x8(&(hash[i]), p, p+(checksum_block_size>>3), p+2*(checksum_block_size>>3), p+3*(checksum_block_size>>3), 
+					p+4*(checksum_block_size>>3), p+5*(checksum_block_size>>3), p+6*(checksum_block_size>>3), p+7*(checksum_block_size>>3), checksum_block_size>>3);
+		for(k=0;k<8;k++)hash[i+k]=mvl_randomize_bits64(hash[i+k]);
+		}
+	}
+
+for(;i<count;i++) {
+	block=checksum_area_start+(first+i)*checksum_block_size;
+	block_stop=block+checksum_block_size;
+	if(block_stop>checksum_area_stop)block_stop=checksum_area_stop;
+	
+	hash[i]=mvl_hash64_checksum_block(checksum_algorithm, data8, block, block_stop);
+	}
+}
+
+/* Compute checksums of count blocks, using several threads for large areas */
+static void mvl_hash64_checksum_blocks_parallel(int checksum_algorithm, const unsigned char *data8, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size, 
+						LIBMVL_OFFSET64 first, LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *hash)
+{
+LIBMVL_OFFSET64 i, n;
+
+MVL_OMP(omp parallel for private(n) schedule(dynamic, 1) if(count*checksum_block_size>=LIBMVL_PARALLEL_CHECKSUM_THRESHOLD))
+for(i=0;i<count;i+=LIBMVL_CHECKSUM_CHUNK) {
+	n=count-i;
+	if(n>LIBMVL_CHECKSUM_CHUNK)n=LIBMVL_CHECKSUM_CHUNK;
+	mvl_hash64_checksum_blocks(checksum_algorithm, data8, checksum_area_start, checksum_area_stop, checksum_block_size, first+i, n, &(hash[i]));
+	}
+}
+
+/* Feed data written at the end of file into block hashes, see mvl_start_streaming_checksums() */
+static void mvl_stream_checksums(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 length, const unsigned char *data)
+{
+LIBMVL_OFFSET64 n, block_size=ctx->stream_checksum_block_size;
+
+while(length>0) {
+	/* Whole blocks of aligned data are hashed in place */
+	if(ctx->stream_block_used==0 && length>=block_size && !(((LIBMVL_OFFSET64)data) & 0x7)) {
+		n=length/block_size;
+		ctx->stream_hashes=mvl_grow_offsets(ctx->stream_hashes, ctx->stream_hashes_count, &ctx->stream_hashes_size, ctx->stream_hashes_count+n);
+		mvl_hash64_checksum_blocks_parallel(ctx->stream_checksum_algorithm, data, 0, n*block_size, block_size, 0, n, &(ctx->stream_hashes[ctx->stream_hashes_count]));
+		ctx->stream_hashes_count+=n;
+		data+=n*block_size;
+		length-=n*block_size;
+		continue;
+		}
+	
+	n=block_size-ctx->stream_block_used;
+	if(n>length)n=length;
+	memcpy(&(ctx->stream_block[ctx->stream_block_used]), data, n);
+	ctx->stream_block_used+=n;
+	data+=n;
+	length-=n;
+	
+	if(ctx->stream_block_used==block_size) {
+		ctx->stream_hashes=mvl_grow_offsets(ctx->stream_hashes, ctx->stream_hashes_count, &ctx->stream_hashes_size, ctx->stream_hashes_count+1);
+		ctx->stream_hashes[ctx->stream_hashes_count]=mvl_hash64_checksum_block(ctx->stream_checksum_algorithm, ctx->stream_block, 0, block_size);
+		ctx->stream_hashes_count++;
+		ctx->stream_block_used=0;
+		}
+	}
+}
+
+/* Streaming checksums can no longer match the file. Hashing stops, only the flag is kept so that mvl_write_streaming_checksum_vector() reports the error */
+static void mvl_stream_checksums_invalidate(LIBMVL_CONTEXT *ctx)
+{
+ctx->stream_checksums_invalid=1;
+free(ctx->stream_block);
+free(ctx->stream_hashes);
+ctx->stream_block=NULL;
+ctx->stream_hashes=NULL;
+ctx->stream_hashes_count=0;
+ctx->stream_hashes_size=0;
+ctx->stream_block_used=0;
+}
+
+/* Note modification of data that has already been fed to streaming checksums */
+static void mvl_stream_checksums_rewrite(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_OFFSET64 length, const unsigned char *data)
+{
+LIBMVL_OFFSET64 block_start;
+
+if(ctx->stream_checksum_block_size==0 || ctx->stream_checksums_invalid || offset+length<=ctx->stream_checksum_start)return;
+
+/* Blocks that have not been hashed yet are patched in place */
+block_start=ctx->stream_checksum_start+ctx->stream_hashes_count*ctx->stream_checksum_block_size;
+if(data!=NULL && offset>=block_start && offset+length<=block_start+ctx->stream_block_used) {
+	memcpy(&(ctx->stream_block[offset-block_start]), data, length);
+	return;
+	}
+mvl_stream_checksums_invalidate(ctx);
+}
+
 void mvl_write(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 length, const void *data)
 {
 LIBMVL_OFFSET64 n;
-n=fwrite(data, 1, length, ctx->f);
-if(n<length)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
+
+if(length<1)return;
+
+if(ctx->stream_checksum_block_size>0 && !ctx->stream_checksums_invalid)mvl_stream_checksums(ctx, length, data);
+
+#ifndef __WIN32__
+if(ctx->direct_write_threshold>0 && length>=ctx->direct_write_threshold) {
+	mvl_flush_write_buffer(ctx);
+	fflush(ctx->f);
+	if(mvl_write_direct(ctx, ctx->write_offset, length, data)<0)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
+	ctx->write_offset+=length;
+	if(fseeko(ctx->f, ctx->write_offset, SEEK_SET)<0)mvl_set_error(ctx, LIBMVL_ERR_CANNOT_SEEK);
+	return;
+	}
+#endif
+
+ctx->write_offset+=length;
+
+if(ctx->write_buffer_used+length<=ctx->write_buffer_size) {
+	memcpy(&(ctx->write_buffer[ctx->write_buffer_used]), data, length);
+	ctx->write_buffer_used+=length;
+	return;
+	}
+
+mvl_flush_write_buffer(ctx);
+
+/* Large writes bypass the buffer */
+if(length>=ctx->write_buffer_size) {
+	n=fwrite(data, 1, length, ctx->f);
+	if(n<length)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
+	return;
+	}
+
+memcpy(ctx->write_buffer, data, length);
+ctx->write_buffer_used=length;
+}
+
+/* Advance write position by length bytes without writing, leaving a hole to be filled later */
+static int mvl_write_skip(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 length)
+{
+/* Holes are filled later, possibly by several threads with mvl_pwrite_vector(), so the checksums are invalidated here once */
+if(ctx->stream_checksum_block_size>0 && !ctx->stream_checksums_invalid)mvl_stream_checksums_invalidate(ctx);
+
+mvl_flush_write_buffer(ctx);
+if(fseeko(ctx->f, length, SEEK_CUR)<0)return(LIBMVL_ERR_CANNOT_SEEK);
+ctx->write_offset+=length;
+return(0);
 }
 
 void mvl_rewrite(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_OFFSET64 length, const void *data)
 {
-LIBMVL_OFFSET64 n;
-off_t cur;
-cur=do_ftello(ctx->f);
-if(cur<0) {
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
+LIBMVL_OFFSET64 n, buffer_start;
+
+mvl_stream_checksums_rewrite(ctx, offset, length, data);
+
+/* Data that is still in the write buffer is modified in place */
+buffer_start=ctx->write_offset-ctx->write_buffer_used;
+if(offset>=buffer_start && offset+length<=ctx->write_offset) {
+	memcpy(&(ctx->write_buffer[offset-buffer_start]), data, length);
+	return;
+	}
+
+mvl_flush_write_buffer(ctx);
+
+#ifndef __WIN32__
+if(ctx->direct_write_threshold>0 && length>=ctx->direct_write_threshold) {
+	fflush(ctx->f);
+	if(mvl_write_direct(ctx, offset, length, data)<0)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
 	return;
 	}
+#endif
+
 if(fseeko(ctx->f, offset, SEEK_SET)<0) {
 	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_SEEK);
 	return;
 	}
 n=fwrite(data, 1, length, ctx->f);
 if(n<length)mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
-if(fseeko(ctx->f, cur, SEEK_SET)<0) {
+if(fseeko(ctx->f, ctx->write_offset, SEEK_SET)<0) {
 	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_SEEK);
 	return;
 	}
@@ -370,13 +730,7 @@ ctx->tmp_vh.length=length;
 ctx->tmp_vh.type=type;
 ctx->tmp_vh.metadata=metadata;
 
-offset=do_ftello(ctx->f);
-
-if(offset<0) {
-	perror("mvl_write_vector");
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
-	return(LIBMVL_NULL_OFFSET);
-	}
+offset=ctx->write_offset;
 
 mvl_write(ctx, sizeof(ctx->tmp_vh), &ctx->tmp_vh);
 mvl_write(ctx, byte_length, data);
@@ -443,14 +797,9 @@ ctx->tmp_vh.length=expected_length;
 ctx->tmp_vh.type=type;
 ctx->tmp_vh.metadata=metadata;
 
-offset=do_ftello(ctx->f);
+offset=ctx->write_offset;
 
-if(offset<0) {
-	perror("mvl_write_vector");
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
-	return(LIBMVL_NULL_OFFSET);
-	}
-	
+mvl_flush_write_buffer(ctx);
 if(do_fallocate(ctx->f, offset, sizeof(ctx->tmp_vh)+total_byte_length+padding)) {
 	mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
 	return(LIBMVL_NULL_OFFSET);
@@ -459,7 +808,7 @@ if(do_fallocate(ctx->f, offset, sizeof(ctx->tmp_vh)+total_byte_length+padding))
 mvl_write(ctx, sizeof(ctx->tmp_vh), &ctx->tmp_vh);
 if(byte_length>0)mvl_write(ctx, byte_length, data);
 if(total_byte_length>byte_length) {
-	if(fseeko(ctx->f, total_byte_length-byte_length, SEEK_CUR)<0) {
+	if(mvl_write_skip(ctx, total_byte_length-byte_length)<0) {
 		mvl_set_error(ctx, LIBMVL_ERR_CANNOT_SEEK);
 		return(LIBMVL_NULL_OFFSET);
 		}
@@ -492,6 +841,176 @@ byte_length=length*elt_size;
 if(byte_length>0)mvl_rewrite(ctx, base_offset+elt_size*idx+sizeof(ctx->tmp_vh), byte_length, data);
 }
 
+/*!  @brief Reserve space for several vectors at once, so that they can be filled in later, possibly by several threads with mvl_pwrite_vector(). 
+ *   This is convenient for writing wide data frames: reserve all columns, fill them in parallel, and then write the named list of columns with mvl_write_named_list_as_data_frame().
+ *   
+ *   The headers are written immediately and vector data is filled with zeros. Space for all vectors is preallocated with a single call.
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @param count number of vectors to reserve
+ *   @param types an array of MVL data types
+ *   @param lengths an array of vector lengths
+ *   @param metadata an optional array of offsets to previously written metadata, can be NULL
+ *   @param offsets an array of count elements that receives vector offsets
+ *   @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_reserve_vectors(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const int *types, const LIBMVL_OFFSET64 *lengths, const LIBMVL_OFFSET64 *metadata, LIBMVL_OFFSET64 *offsets)
+{
+LIBMVL_VECTOR_HEADER vh;
+LIBMVL_OFFSET64 i, byte_length, padding, total;
+int err;
+
+total=0;
+for(i=0;i<count;i++) {
+	byte_length=lengths[i]*mvl_element_size(types[i]);
+	if(mvl_element_size(types[i])<1) {
+		mvl_set_error(ctx, LIBMVL_ERR_UNKNOWN_TYPE);
+		return(LIBMVL_ERR_UNKNOWN_TYPE);
+		}
+	padding=(ctx->alignment-((byte_length+sizeof(vh)) & (ctx->alignment-1))) & (ctx->alignment-1);
+	total+=sizeof(vh)+byte_length+padding;
+	}
+
+mvl_flush_write_buffer(ctx);
+if(do_fallocate(ctx->f, ctx->write_offset, total)) {
+	mvl_set_error(ctx, LIBMVL_ERR_INCOMPLETE_WRITE);
+	return(LIBMVL_ERR_INCOMPLETE_WRITE);
+	}
+
+for(i=0;i<count;i++) {
+	byte_length=lengths[i]*mvl_element_size(types[i]);
+	padding=(ctx->alignment-((byte_length+sizeof(vh)) & (ctx->alignment-1))) & (ctx->alignment-1);
+	
+	memset(&vh, 0, sizeof(vh));
+	vh.length=lengths[i];
+	vh.type=types[i];
+	vh.metadata=metadata==NULL ? LIBMVL_NO_METADATA : metadata[i];
+	
+	offsets[i]=ctx->write_offset;
+	mvl_write(ctx, sizeof(vh), &vh);
+	/* Data and padding are zero filled by preallocation */
+	if((err=mvl_write_skip(ctx, byte_length+padding))<0) {
+		mvl_set_error(ctx, err);
+		return(err);
+		}
+	}
+return(0);
+}
+
+/*!  @brief Write data into a vector reserved with mvl_reserve_vectors() or mvl_start_write_vector(). 
+ *   Unlike mvl_rewrite_vector() this function does not change the state of the context, and can be called from several threads at once, 
+ *   as long as no other functions write to the same context at the same time.
+ *   The vector header must already be in the file, which is the case for vectors that were reserved with space left to fill.
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @param type MVL data type
+ *   @param base_offset the offset of the vector
+ *   @param idx  index of of first element pointed to by data
+ *   @param length number of elements to write
+ *   @param data  pointer to data
+ *   @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_pwrite_vector(LIBMVL_CONTEXT *ctx, int type, LIBMVL_OFFSET64 base_offset, LIBMVL_OFFSET64 idx, LIBMVL_OFFSET64 length, const void *data)
+{
+#ifndef __WIN32__
+LIBMVL_VECTOR_HEADER vh;
+LIBMVL_OFFSET64 byte_length, offset, k;
+ssize_t n;
+
+if(pread(fileno(ctx->f), &vh, sizeof(vh), base_offset)!=sizeof(vh))return(LIBMVL_ERR_INVALID_OFFSET);
+if(vh.type!=type)return(LIBMVL_ERR_INVALID_HEADER);
+if(idx>vh.length || length>vh.length-idx)return(LIBMVL_ERR_INVALID_LENGTH);
+
+byte_length=length*mvl_element_size(type);
+offset=base_offset+idx*mvl_element_size(type)+sizeof(LIBMVL_VECTOR_HEADER);
+
+for(k=0;k<byte_length;k+=n) {
+	n=pwrite(fileno(ctx->f), &(((const unsigned char *)data)[k]), byte_length-k, offset+k);
+	if(n<=0)return(LIBMVL_ERR_INCOMPLETE_WRITE);
+	}
+return(0);
+#else
+return(LIBMVL_ERR_INVALID_PARAMETER);
+#endif
+}
+
+/*!  @brief Memory map data of a vector reserved with mvl_start_write_vector() or mvl_reserve_vectors(), so that it can be filled in place without any system calls. 
+ *   The file must have been opened for both reading and writing, for example with fopen(name, "w+"), as memory maps cannot be write-only.
+ *   Other vectors can be written as usual while the map is in use. 
+ *   
+ *   Use mvl_sync_vector_map() to commit changes to storage and mvl_unmap_vector() to release the map. Both should be done before mvl_close().
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @param offset offset of the vector
+ *   @param map a structure that receives the map. The vector data is available via map->data
+ *   @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_map_vector_for_write(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_VECTOR_MAP *map)
+{
+#ifndef __WIN32__
+LIBMVL_VECTOR_HEADER vh;
+LIBMVL_OFFSET64 start, stop, page_size;
+void *p;
+
+memset(map, 0, sizeof(*map));
+
+/* The header may still be in the write buffer */
+mvl_flush_write_buffer(ctx);
+fflush(ctx->f);
+
+if(pread(fileno(ctx->f), &vh, sizeof(vh), offset)!=sizeof(vh))return(LIBMVL_ERR_INVALID_OFFSET);
+if(mvl_element_size(vh.type)<1)return(LIBMVL_ERR_INVALID_HEADER);
+
+page_size=sysconf(_SC_PAGESIZE);
+start=offset+sizeof(vh);
+stop=start+vh.length*mvl_element_size(vh.type);
+if(stop>ctx->write_offset)return(LIBMVL_ERR_INVALID_LENGTH);
+
+mvl_stream_checksums_rewrite(ctx, start, stop-start, NULL);
+
+map->type=vh.type;
+map->length=vh.length;
+if(stop==start)return(0);
+
+map->mapping_offset=start-(start % page_size);
+map->mapping_length=stop-map->mapping_offset;
+
+p=mmap(NULL, map->mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(ctx->f), map->mapping_offset);
+if(p==MAP_FAILED) {
+	memset(map, 0, sizeof(*map));
+	return(LIBMVL_ERR_CANNOT_MAP);
+	}
+map->mapping=p;
+map->data=&(((unsigned char *)p)[start-map->mapping_offset]);
+return(0);
+#else
+memset(map, 0, sizeof(*map));
+return(LIBMVL_ERR_CANNOT_MAP);
+#endif
+}
+
+/*!  @brief Commit changes made through a map created with mvl_map_vector_for_write()
+ *   @param map vector map
+ *   @param wait if non-zero wait until the data is written to storage, otherwise only schedule the write
+ *   @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_sync_vector_map(LIBMVL_VECTOR_MAP *map, int wait)
+{
+#ifndef __WIN32__
+if(map->mapping==NULL)return(0);
+if(msync(map->mapping, map->mapping_length, wait ? MS_SYNC : MS_ASYNC)<0)return(LIBMVL_ERR_INCOMPLETE_WRITE);
+#endif
+return(0);
+}
+
+/*!  @brief Release a map created with mvl_map_vector_for_write(). Changes become part of the file even without calling mvl_sync_vector_map() first.
+ *   @param map vector map
+ */
+void mvl_unmap_vector(LIBMVL_VECTOR_MAP *map)
+{
+#ifndef __WIN32__
+if(map->mapping!=NULL)munmap(map->mapping, map->mapping_length);
+#endif
+memset(map, 0, sizeof(*map));
+}
+
 /*!  @brief Write MVL vector that contains data at specific indices. The indices can repeat, and can themselves be stored in memory mapped MVL file.
  *   @param ctx MVL context pointer that has been initialized for writing
  *   @param index_count number of indices to process, this will determine the length of the new vector
@@ -692,12 +1211,7 @@ ctx->tmp_vh.length=length;
 ctx->tmp_vh.type=type;
 ctx->tmp_vh.metadata=metadata;
 
-offset=do_ftello(ctx->f);
-
-if((long long int)offset<0) {
-	perror("mvl_write_vector");
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
-	}
+offset=ctx->write_offset;
 
 mvl_write(ctx, sizeof(ctx->tmp_vh), &ctx->tmp_vh);
 for(i=0;i<nvec;i++)
@@ -855,56 +1369,29 @@ return(ofs2);
 #define LIBMVL_INTERNAL1_HASH64_BLOCKSIZE 65536
 #endif
 
-/*! @brief Compute and write checksums for a given area
- *   @param ctx MVL context pointer that has been initialized for writing
- *   @param data base address. Usually the base address of memory mapped MVL file. Must be properly aligned. A possible reason for alignment errors is mmap() returning MAP_FAILED. If data is NULL then this function will use base address from context initialized by mvl_load_image()
- *   @param checksum_area_start byte offset of start of area to checksum. Set to 0 to checksum from beginning of MVL file. Must be multiple of 8.
- *   @param checksum_area_stop byte offset of first entry past the end of checksummed area. Must be multiple of 8.
- *   @param checksum_block_size byte size of checksum blocks. Must be multiple of 8.
- *   @return an offset into the file, suitable for adding to MVL file directory, or to other MVL objects
- */
-LIBMVL_OFFSET64 mvl_write_hash64_checksum_vector(LIBMVL_CONTEXT *ctx, void *data, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size)
+/* Write checksum vector. The first known_count block hashes are taken from known_hashes, the rest are computed from data8 */
+static LIBMVL_OFFSET64 mvl_write_checksums(LIBMVL_CONTEXT *ctx, int checksum_algorithm, const unsigned char *data8, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size, 
+					   LIBMVL_OFFSET64 known_count, const LIBMVL_OFFSET64 *known_hashes)
 {
 LIBMVL_CHECKSUM_VECTOR_HEADER *hdr=(LIBMVL_CHECKSUM_VECTOR_HEADER *)(&ctx->tmp_vh);
 LIBMVL_OFFSET64 *buffer;
 LIBMVL_OFFSET64 byte_length, padding;
 LIBMVL_OFFSET64 buffer_idx;
-LIBMVL_OFFSET64 block, block_stop;
-LIBMVL_OFFSET64 hash;
+LIBMVL_OFFSET64 block;
 LIBMVL_OFFSET64 offset;
-unsigned char *data8;
 unsigned char *zeros;
 
-if(data==NULL) {
-	data=ctx->data;
-
-	if(data==NULL) {
-		mvl_set_error(ctx, LIBMVL_ERR_NO_DATA);
-		return(LIBMVL_NULL_OFFSET);
-		}
-	}
-	
-data8=(unsigned char *)data;
-
-if(((LIBMVL_OFFSET64)(data)) & 0x7) { 
-	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_POINTER);
-	return(LIBMVL_NULL_OFFSET);
-	}
-
-if((checksum_area_start & 0x7) || (checksum_block_size & 0x7) || (checksum_area_stop & 0x7)) { 
-	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_OFFSET);
-	return(LIBMVL_NULL_OFFSET);
-	}
-	
 memset(hdr, 0, sizeof(*hdr));
 hdr->type=LIBMVL_VECTOR_CHECKSUM;
-hdr->checksum_algorithm=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64;
+hdr->checksum_algorithm=checksum_algorithm;
 hdr->checksum_area_start=checksum_area_start;
 hdr->checksum_area_stop=checksum_area_stop;
 hdr->checksum_block_size=checksum_block_size;
 hdr->length=(checksum_area_stop-checksum_area_start+checksum_block_size-1)/checksum_block_size;
 hdr->metadata=LIBMVL_NULL_OFFSET;
 
+if(known_count>hdr->length)known_count=hdr->length;
+
 byte_length=hdr->length*8;
 padding=ctx->alignment-((byte_length+sizeof(ctx->tmp_vh)) & (ctx->alignment-1));
 padding=padding & (ctx->alignment-1);
@@ -912,36 +1399,18 @@ padding=padding & (ctx->alignment-1);
 	
 buffer=do_malloc(LIBMVL_INTERNAL1_HASH64_BLOCKSIZE, sizeof(*buffer));
 	
-offset=do_ftello(ctx->f);
-
-if((long long int)offset<0) {
-	perror("mvl_write_vector");
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
-	}
+offset=ctx->write_offset;
 
 mvl_write(ctx, sizeof(ctx->tmp_vh), &ctx->tmp_vh);
 
-buffer_idx=0;
-for(block=checksum_area_start;block<checksum_area_stop;block+=checksum_block_size) {
-	block_stop=block+checksum_block_size;
-	if(block_stop>checksum_area_stop)block_stop=checksum_area_stop;
+if(known_count>0)mvl_write(ctx, known_count*sizeof(*known_hashes), known_hashes);
 
-	hash=MVL_SEED_HASH_VALUE;
-	hash=mvl_accumulate_int64_hash64(hash, (long long *)&(data8[block]), (block_stop-block)>>3);
-	hash=mvl_randomize_bits64(hash);
-
-	buffer[buffer_idx]=hash;
-	buffer_idx++;
-	
-	if(buffer_idx>=LIBMVL_INTERNAL1_HASH64_BLOCKSIZE) {
-		mvl_write(ctx, buffer_idx*sizeof(*buffer), buffer);
-		buffer_idx=0;
-		}
-	}
+for(block=known_count;block<hdr->length;block+=LIBMVL_INTERNAL1_HASH64_BLOCKSIZE) {
+	buffer_idx=hdr->length-block;
+	if(buffer_idx>LIBMVL_INTERNAL1_HASH64_BLOCKSIZE)buffer_idx=LIBMVL_INTERNAL1_HASH64_BLOCKSIZE;
 	
-if(buffer_idx>0) {
+	mvl_hash64_checksum_blocks_parallel(checksum_algorithm, data8, checksum_area_start, checksum_area_stop, checksum_block_size, block, buffer_idx, buffer);
 	mvl_write(ctx, buffer_idx*sizeof(*buffer), buffer);
-	buffer_idx=0;
 	}
 
 if(padding>0) {
@@ -954,7 +1423,267 @@ free(buffer);
 return(offset);
 }
 
-/*! @brief Compute and verify checksums for a given area
+/*! @brief Select algorithm used by mvl_write_hash64_checksum_vector(). Checksum vectors record the algorithm, so files written with any supported algorithm can be verified.
+ *   @param ctx MVL context pointer
+ *   @param checksum_algorithm one of LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64 (default) or LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64
+ *   @return 0 on success, LIBMVL_ERR_UNKNOWN_CHECKSUM_ALGORITHM otherwise
+ */
+int mvl_set_checksum_algorithm(LIBMVL_CONTEXT *ctx, int checksum_algorithm)
+{
+if(checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64 && checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64) {
+	mvl_set_error(ctx, LIBMVL_ERR_UNKNOWN_CHECKSUM_ALGORITHM);
+	return(LIBMVL_ERR_UNKNOWN_CHECKSUM_ALGORITHM);
+	}
+ctx->checksum_algorithm=checksum_algorithm;
+return(0);
+}
+
+/*! @brief Compute and write checksums for a given area, using algorithm selected with mvl_set_checksum_algorithm()
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @param data base address. Usually the base address of memory mapped MVL file. Must be properly aligned. A possible reason for alignment errors is mmap() returning MAP_FAILED. If data is NULL then this function will use base address from context initialized by mvl_load_image()
+ *   @param checksum_area_start byte offset of start of area to checksum. Set to 0 to checksum from beginning of MVL file. Must be multiple of 8.
+ *   @param checksum_area_stop byte offset of first entry past the end of checksummed area. Must be multiple of 8.
+ *   @param checksum_block_size byte size of checksum blocks. Must be multiple of 8.
+ *   @return an offset into the file, suitable for adding to MVL file directory, or to other MVL objects
+ */
+LIBMVL_OFFSET64 mvl_write_hash64_checksum_vector(LIBMVL_CONTEXT *ctx, void *data, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size)
+{
+unsigned char *data8;
+
+if(data==NULL) {
+	data=ctx->data;
+
+	if(data==NULL) {
+		mvl_set_error(ctx, LIBMVL_ERR_NO_DATA);
+		return(LIBMVL_NULL_OFFSET);
+		}
+	}
+	
+data8=(unsigned char *)data;
+
+if(((LIBMVL_OFFSET64)(data)) & 0x7) { 
+	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_POINTER);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+if((checksum_area_start & 0x7) || (checksum_block_size & 0x7) || (checksum_area_stop & 0x7)) { 
+	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_OFFSET);
+	return(LIBMVL_NULL_OFFSET);
+	}
+	
+return(mvl_write_checksums(ctx, ctx->checksum_algorithm, data8, checksum_area_start, checksum_area_stop, checksum_block_size, 0, NULL));
+}
+
+/*! @brief Compute and write checksums for an area that extends the area covered by an existing checksum vector, for example after appending vectors to MVL file with mvl_open_append().
+ *   Hashes of blocks that lie entirely within the old area are copied, only the new blocks and the last, partially filled, old block are hashed.
+ *   The new checksum vector uses the same algorithm, area start and block size as the old one.
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @param checksum_vector pointer to existing checksum vector
+ *   @param data base address, such as the base address of memory mapped MVL file. Only the area past the last full block of the old checksum vector is accessed. Must be properly aligned.
+ *   @param checksum_area_stop byte offset of first entry past the end of new checksummed area. Must be multiple of 8 and not less than checksum_area_stop of the old vector.
+ *   @return an offset into the file, suitable for adding to MVL file directory, or to other MVL objects
+ */
+LIBMVL_OFFSET64 mvl_extend_checksum_vector(LIBMVL_CONTEXT *ctx, const LIBMVL_VECTOR *checksum_vector, void *data, LIBMVL_OFFSET64 checksum_area_stop)
+{
+LIBMVL_CHECKSUM_VECTOR_HEADER *hdr;
+LIBMVL_OFFSET64 known_count;
+
+if(data==NULL) {
+	data=ctx->data;
+
+	if(data==NULL) {
+		mvl_set_error(ctx, LIBMVL_ERR_NO_DATA);
+		return(LIBMVL_NULL_OFFSET);
+		}
+	}
+
+if(((LIBMVL_OFFSET64)(data)) & 0x7) { 
+	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_POINTER);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+hdr=(LIBMVL_CHECKSUM_VECTOR_HEADER *)(checksum_vector);
+
+if(hdr->type!=LIBMVL_VECTOR_CHECKSUM || hdr->checksum_block_size<8 || (hdr->checksum_block_size & 0x7)) {
+	mvl_set_error(ctx, LIBMVL_ERR_INVALID_HEADER);
+	return(LIBMVL_NULL_OFFSET);
+	}
+	
+if(hdr->checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64 && hdr->checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64) {
+	mvl_set_error(ctx, LIBMVL_ERR_UNKNOWN_CHECKSUM_ALGORITHM);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+if(checksum_area_stop & 0x7) { 
+	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_OFFSET);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+if(checksum_area_stop<hdr->checksum_area_stop) {
+	mvl_set_error(ctx, LIBMVL_ERR_INVALID_OFFSET);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+known_count=(hdr->checksum_area_stop-hdr->checksum_area_start)/hdr->checksum_block_size;
+
+if(hdr->length<known_count) {
+	mvl_set_error(ctx, LIBMVL_ERR_INVALID_HEADER);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+return(mvl_write_checksums(ctx, hdr->checksum_algorithm, (unsigned char *)data, hdr->checksum_area_start, checksum_area_stop, hdr->checksum_block_size, known_count, mvl_vector_data_offset(checksum_vector)));
+}
+
+/*! @brief Compute block checksums of all data written from now on, as it passes through the writer. This avoids reading the file back to checksum it.
+ *   When called before mvl_open() the checksums start at the beginning of the file, when called before mvl_open_append() they start at the old end of the file, otherwise at the current write position. The algorithm is selected with mvl_set_checksum_algorithm().
+ *   
+ *   Data modified after it was written with mvl_rewrite_vector() can only be accounted for while it is in the last, unfinished block. 
+ *   Vectors reserved for later filling, with mvl_reserve_vectors() or a partial mvl_start_write_vector(), and vectors mapped with mvl_map_vector_for_write() always invalidate the checksums.
+ *   In these cases mvl_write_streaming_checksum_vector() reports LIBMVL_ERR_CHECKSUMS_INVALIDATED, and the checksums have to be computed with mvl_write_hash64_checksum_vector() instead.
+ *   @param ctx MVL context pointer
+ *   @param checksum_block_size byte size of checksum blocks. Must be multiple of 8.
+ *   @return 0 on success, negative error code otherwise
+ */
+int mvl_start_streaming_checksums(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 checksum_block_size)
+{
+if(checksum_block_size<8 || (checksum_block_size & 0x7) || (ctx->write_offset & 0x7)) {
+	mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_OFFSET);
+	return(LIBMVL_ERR_UNALIGNED_OFFSET);
+	}
+
+free(ctx->stream_block);
+free(ctx->stream_hashes);
+ctx->stream_block=do_malloc(checksum_block_size, 1);
+ctx->stream_block_used=0;
+ctx->stream_hashes=NULL;
+ctx->stream_hashes_count=0;
+ctx->stream_hashes_size=0;
+ctx->stream_checksums_invalid=0;
+ctx->stream_checksum_algorithm=ctx->checksum_algorithm;
+ctx->stream_checksum_start=ctx->write_offset;
+ctx->stream_checksum_block_size=checksum_block_size;
+return(0);
+}
+
+/*! @brief Stop computing streaming checksums and write checksum vector covering all data written since mvl_start_streaming_checksums(). 
+ *   Usually the returned offset is added to the directory with LIBMVL_FULL_CHECKSUMS_DIRECTORY_KEY.
+ *   @param ctx MVL context pointer that has been initialized for writing
+ *   @return an offset into the file, suitable for adding to MVL file directory, or to other MVL objects
+ */
+LIBMVL_OFFSET64 mvl_write_streaming_checksum_vector(LIBMVL_CONTEXT *ctx)
+{
+LIBMVL_OFFSET64 checksum_block_size, checksum_area_stop, offset;
+
+checksum_block_size=ctx->stream_checksum_block_size;
+if(checksum_block_size==0) {
+	mvl_set_error(ctx, LIBMVL_ERR_NO_CHECKSUMS);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+/* The checksum vector itself is not covered */
+ctx->stream_checksum_block_size=0;
+
+offset=LIBMVL_NULL_OFFSET;
+checksum_area_stop=ctx->stream_checksum_start+ctx->stream_hashes_count*checksum_block_size+ctx->stream_block_used;
+
+if(ctx->stream_checksums_invalid || (ctx->stream_block_used & 0x7)) {
+	mvl_set_error(ctx, ctx->stream_checksums_invalid ? LIBMVL_ERR_CHECKSUMS_INVALIDATED : LIBMVL_ERR_UNALIGNED_OFFSET);
+	} else {
+	if(ctx->stream_block_used>0) {
+		ctx->stream_hashes=mvl_grow_offsets(ctx->stream_hashes, ctx->stream_hashes_count, &ctx->stream_hashes_size, ctx->stream_hashes_count+1);
+		ctx->stream_hashes[ctx->stream_hashes_count]=mvl_hash64_checksum_block(ctx->stream_checksum_algorithm, ctx->stream_block, 0, ctx->stream_block_used);
+		ctx->stream_hashes_count++;
+		}
+	offset=mvl_write_checksums(ctx, ctx->stream_checksum_algorithm, NULL, ctx->stream_checksum_start, checksum_area_stop, checksum_block_size, ctx->stream_hashes_count, ctx->stream_hashes);
+	}
+
+free(ctx->stream_block);
+free(ctx->stream_hashes);
+ctx->stream_block=NULL;
+ctx->stream_hashes=NULL;
+ctx->stream_hashes_count=0;
+ctx->stream_hashes_size=0;
+ctx->stream_block_used=0;
+return(offset);
+}
+
+/* Bitmap words are read and updated atomically, so that several threads can verify vectors of the same context */
+static inline LIBMVL_OFFSET64 mvl_bitmap_load(const LIBMVL_OFFSET64 *word)
+{
+#ifdef __GNUC__
+return(__atomic_load_n(word, __ATOMIC_RELAXED));
+#else
+return(*word);
+#endif
+}
+
+static inline void mvl_bitmap_or(LIBMVL_OFFSET64 *word, LIBMVL_OFFSET64 mask)
+{
+#ifdef __GNUC__
+__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+#else
+MVL_OMP(omp atomic)
+*word|=mask;
+#endif
+}
+
+/* Flag shared by threads verifying checksums, so that all of them stop on the first failed block */
+static inline int mvl_flag_load(const int *flag)
+{
+#ifdef __GNUC__
+return(__atomic_load_n(flag, __ATOMIC_RELAXED));
+#else
+int v;
+MVL_OMP(omp atomic read)
+v=*flag;
+return(v);
+#endif
+}
+
+static inline void mvl_flag_set(int *flag)
+{
+#ifdef __GNUC__
+__atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+#else
+MVL_OMP(omp atomic write)
+*flag=1;
+#endif
+}
+
+/* Allocate empty bitmap of verified blocks for full checksums of the loaded image */
+static void mvl_reset_verified_blocks(LIBMVL_CONTEXT *ctx)
+{
+LIBMVL_CHECKSUM_VECTOR_HEADER *hdr;
+
+free(ctx->verified_blocks);
+ctx->verified_blocks=NULL;
+ctx->verified_blocks_length=0;
+
+if(!ctx->lazy_verification || ctx->data==NULL || ctx->full_checksums_offset==LIBMVL_NULL_OFFSET)return;
+
+hdr=(LIBMVL_CHECKSUM_VECTOR_HEADER *)&(ctx->data[ctx->full_checksums_offset]);
+if(hdr->type!=LIBMVL_VECTOR_CHECKSUM)return;
+
+ctx->verified_blocks_length=(hdr->length+63)>>6;
+ctx->verified_blocks=do_malloc(ctx->verified_blocks_length, sizeof(*ctx->verified_blocks));
+memset(ctx->verified_blocks, 0, ctx->verified_blocks_length*sizeof(*ctx->verified_blocks));
+}
+
+/*! @brief Remember which blocks passed verification against full checksums of the loaded image, so that each block is hashed at most once per context.
+ *   When enabled, mvl_verify_checksum_vector(), mvl_verify_checksum_vector2() and mvl_verify_checksum_vector3() called with full checksums skip blocks that were already verified.
+ *   This makes checking each vector on first access cheap, without verifying the entire file at open time. Verification can then be done by several threads at once.
+ *   
+ *   The record of verified blocks is allocated by this function and by mvl_load_image(), so call it before the context is shared between threads.
+ *   @param ctx MVL context pointer
+ *   @param enable non-zero to enable, 0 to disable
+ */
+void mvl_set_lazy_verification(LIBMVL_CONTEXT *ctx, int enable)
+{
+ctx->lazy_verification=enable;
+mvl_reset_verified_blocks(ctx);
+}
+
+/*! @brief Compute and verify checksums for a given area. Large areas are verified by several threads, which stop on the first failed block
  *   @param ctx MVL context pointer that has been initialized for reading
  *   @param checksum_vector pointer to checksum vector. You can pass NULL to use full checksums.
  *   @param data base address. Usually the base address of memory mapped MVL file. Must be properly aligned. A possible reason for alignment errors is mmap() returning MAP_FAILED. If data is NULL then this function will use base address from context initialized by mvl_load_image()
@@ -966,9 +1695,12 @@ return(offset);
 int mvl_verify_checksum_vector(LIBMVL_CONTEXT *ctx, const LIBMVL_VECTOR *checksum_vector, void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop)
 {
 LIBMVL_CHECKSUM_VECTOR_HEADER *hdr;
-LIBMVL_OFFSET64 block, buffer_idx, block_stop, hash, start2, stop2;
+LIBMVL_OFFSET64 block, block_stop, start2, stop2;
+LIBMVL_OFFSET64 first, last, word, b0, b1, i, mask, verified;
+LIBMVL_OFFSET64 hash[64];
 unsigned char *data8;
-LIBMVL_OFFSET64 *buffer;
+LIBMVL_OFFSET64 *buffer, *bitmap;
+int failed, bad;
 
 if(stop==start) {
 	/* Nothing to check */
@@ -1003,7 +1735,7 @@ if(hdr->type!=LIBMVL_VECTOR_CHECKSUM) {
 	return(-3);
 	}
 	
-if(hdr->checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64) {
+if(hdr->checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64 && hdr->checksum_algorithm!=LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64) {
 	mvl_set_error(ctx, LIBMVL_ERR_UNKNOWN_CHECKSUM_ALGORITHM);
 	return(-4);
 	}
@@ -1036,22 +1768,58 @@ if(stop2>data_size) {
 	return(-8);
 	}
 
-buffer_idx=(start2-hdr->checksum_area_start) / hdr->checksum_block_size;
+first=(start2-hdr->checksum_area_start) / hdr->checksum_block_size;
+last=(stop2-hdr->checksum_area_start+hdr->checksum_block_size-1) / hdr->checksum_block_size;
 
-for(block=start2;block<stop2;block+=hdr->checksum_block_size) {
-	
-	block_stop=block+hdr->checksum_block_size;
-	if(block_stop>hdr->checksum_area_stop)block_stop=hdr->checksum_area_stop;
+bitmap=NULL;
+if(ctx->lazy_verification && data8==ctx->data && ctx->full_checksums_offset!=LIBMVL_NULL_OFFSET && (unsigned char *)checksum_vector==&(data8[ctx->full_checksums_offset]))
+	bitmap=ctx->verified_blocks;
 
-	hash=MVL_SEED_HASH_VALUE;
-	hash=mvl_accumulate_int64_hash64(hash, (long long *)&(data8[block]), (block_stop-block)>>3);
-	hash=mvl_randomize_bits64(hash);
+/* Each iteration covers blocks sharing one bitmap word, so threads never update the same word */
+failed=0;
+MVL_OMP(omp parallel for private(b0, b1, i, mask, verified, block, block_stop, hash, bad) schedule(dynamic, 1) if((last-first)*hdr->checksum_block_size>=LIBMVL_PARALLEL_CHECKSUM_THRESHOLD))
+for(word=first>>6;word<=((last-1)>>6);word++) {
+	if(mvl_flag_load(&failed))continue;
+	
+	b0=word<<6;
+	if(b0<first)b0=first;
+	b1=(word+1)<<6;
+	if(b1>last)b1=last;
 	
-	if(buffer[buffer_idx]!=hash) {
-		mvl_set_error(ctx, LIBMVL_ERR_CHECKSUM_FAILED);
-		return(-255);
+	mask=(b1-b0<64) ? (((1LLU<<(b1-b0))-1)<<(b0 & 63)) : ~0LLU;
+	verified=(bitmap!=NULL) ? mvl_bitmap_load(&(bitmap[word])) & mask : 0;
+	if(verified==mask)continue;
+	bad=0;
+	
+	if(verified==0) {
+		mvl_hash64_checksum_blocks(hdr->checksum_algorithm, data8, hdr->checksum_area_start, hdr->checksum_area_stop, hdr->checksum_block_size, b0, b1-b0, hash);
+		for(i=b0;i<b1;i++) {
+			if(buffer[i]!=hash[i-b0]) {
+				bad=1;
+				break;
+				}
+			}
+		} else {
+		for(i=b0;i<b1;i++) {
+			if(verified & (1LLU<<(i & 63)))continue;
+			block=hdr->checksum_area_start+i*hdr->checksum_block_size;
+			block_stop=block+hdr->checksum_block_size;
+			if(block_stop>hdr->checksum_area_stop)block_stop=hdr->checksum_area_stop;
+			
+			if(buffer[i]!=mvl_hash64_checksum_block(hdr->checksum_algorithm, data8, block, block_stop)) {
+				bad=1;
+				break;
+				}
+			}
 		}
-	buffer_idx++;
+	
+	if(bad)mvl_flag_set(&failed);
+		else if(bitmap!=NULL)mvl_bitmap_or(&(bitmap[word]), mask);
+	}
+
+if(failed) {
+	mvl_set_error(ctx, LIBMVL_ERR_CHECKSUM_FAILED);
+	return(-255);
 	}
 	
 return(0);
@@ -1285,12 +2053,7 @@ for(int i=0;i<ctx->directory->free;i++) {
 	}
 
 	
-cur=do_ftello(ctx->f);
-
-if((long long int)cur<0) {
-	perror("mvl_write_directory");
-	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
-	}
+cur=ctx->write_offset;
 offset=cur;
 
 mvl_write_vector(ctx, LIBMVL_VECTOR_OFFSET64, 2*ctx->directory->free, p, LIBMVL_NO_METADATA);
@@ -1326,6 +2089,8 @@ L->hash_size=0;
 L->next_item=NULL;
 L->first_item=NULL;
 
+L->external_tags=0;
+
 return(L);
 }
 
@@ -1335,7 +2100,7 @@ return(L);
 void mvl_free_named_list(LIBMVL_NAMED_LIST *L)
 {
 long i;
-for(i=0;i<L->free;i++)free(L->tag[i]);
+for(i=L->external_tags;i<L->free;i++)free(L->tag[i]);
 free(L->next_item);
 free(L->first_item);
 free(L->offset);
@@ -1377,6 +2142,16 @@ for(LIBMVL_OFFSET64 i=0;i<L->free;i++) {
 	}
 }
 
+/*! @brief Make copies of tags that point into memory mapped data, so that LIBMVL_NAMED_LIST read from MVL file can be used after the data is unmapped
+ *   @param L pointer to previously allocated LIBMVL_NAMED_LIST
+ */
+void mvl_named_list_copy_tags(LIBMVL_NAMED_LIST *L)
+{
+long i;
+for(i=0;i<L->external_tags;i++)L->tag[i]=(unsigned char*)memndup((const char *)L->tag[i], L->tag_length[i]);
+L->external_tags=0;
+}
+
 /*! @brief Add entry to LIBMVL_NAMED_LIST. The entry is always appended to the end.
  *   @param L pointer to previously allocated LIBMVL_NAMED_LIST
  *   @param tag_length size of tag
@@ -1497,7 +2272,45 @@ free(offsets);
 return(attr_offset);
 }
 
+/* Named lists with at least this many entries are written with a hash table */
+#ifndef LIBMVL_NAMED_LIST_HASH_THRESHOLD
+#define LIBMVL_NAMED_LIST_HASH_THRESHOLD	1024
+#endif
+
+/* Write hash table of L as LIBMVL_NAMED_LIST_HASH_VERSION, then hash_size first items followed by L->free next items, in the same layout as mvl_recompute_named_list_hash(). 
+ * 32-bit integers are used unless the list is very large */
+static LIBMVL_OFFSET64 mvl_write_named_list_hash(LIBMVL_CONTEXT *ctx, LIBMVL_NAMED_LIST *L)
+{
+long long *h;
+int *h32;
+LIBMVL_OFFSET64 hs, mask, i, k, offset;
+
+hs=1;
+while(hs<L->free)hs=hs<<1;
+mask=hs-1;
+
+h=do_malloc(1+hs+L->free, sizeof(*h));
+h[0]=LIBMVL_NAMED_LIST_HASH_VERSION;
+for(i=1;i<=hs;i++)h[i]=-1;
+for(i=0;i<L->free;i++) {
+	k=1+(mvl_accumulate_hash64(MVL_SEED_HASH_VALUE, L->tag[i], L->tag_length[i]) & mask);
+	h[1+hs+i]=h[k];
+	h[k]=i;
+	}
+
+if(L->free<(1LL<<31)) {
+	h32=do_malloc(1+hs+L->free, sizeof(*h32));
+	for(i=0;i<1+hs+L->free;i++)h32[i]=h[i];
+	offset=mvl_write_vector(ctx, LIBMVL_VECTOR_INT32, 1+hs+L->free, h32, LIBMVL_NO_METADATA);
+	free(h32);
+	} else
+	offset=mvl_write_vector(ctx, LIBMVL_VECTOR_INT64, 1+hs+L->free, h, LIBMVL_NO_METADATA);
+free(h);
+return(offset);
+}
+
 /*! @brief Write out named list. In R, this would be read back as list.
+ *   Lists with many entries, such as large MVL directories, also store their hash table, so that it does not have to be recomputed when the list is read back.
  *   @param ctx MVL context pointer that has been initialized for writing
  *   @param L previously created named list
  *   @return an offset into the file, suitable for adding to MVL file directory, or to other MVL objects
@@ -1510,6 +2323,7 @@ LIBMVL_NAMED_LIST *metadata;
 metadata=mvl_create_R_attributes_list(ctx, "list");
 //mvl_add_list_entry(metadata, -1, "names", mvl_write_vector(ctx, LIBMVL_VECTOR_OFFSET64, L->free, offsets, LIBMVL_NO_METADATA));
 mvl_add_list_entry(metadata, -1, "names", mvl_write_packed_list(ctx, L->free, L->tag_length, L->tag, LIBMVL_NO_METADATA));
+if(L->free>=LIBMVL_NAMED_LIST_HASH_THRESHOLD)mvl_add_list_entry(metadata, -1, LIBMVL_NAMED_LIST_HASH_ATTRIBUTE, mvl_write_named_list_hash(ctx, L));
 
 list_offset=mvl_write_vector(ctx, LIBMVL_VECTOR_OFFSET64, L->free, L->offset, mvl_write_attributes_list(ctx, metadata));
 
@@ -1566,15 +2380,80 @@ mvl_free_named_list(metadata);
 return(list_offset);
 }
 
+/* Fill entry i of a named list that references tags in memory mapped data */
+static inline void mvl_set_list_view_entry(LIBMVL_NAMED_LIST *L, long i, long tag_length, const char *tag, LIBMVL_OFFSET64 offset)
+{
+L->offset[i]=offset;
+L->tag_length[i]=tag_length;
+L->tag[i]=(unsigned char *)tag;
+}
+
+/* Number of chain heads checked against their bucket when a stored hash table is loaded */
+#ifndef LIBMVL_NAMED_LIST_HASH_SAMPLES
+#define LIBMVL_NAMED_LIST_HASH_SAMPLES	64
+#endif
+
+/* Use hash table stored by mvl_write_named_list(), return 0 on success */
+static int mvl_load_named_list_hash(LIBMVL_NAMED_LIST *L, const char *d, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 hash_ofs)
+{
+const LIBMVL_VECTOR *vec;
+LIBMVL_OFFSET64 hs, i, n, step;
+long long v;
+
+if(hash_ofs==LIBMVL_NULL_OFFSET || mvl_validate_vector(hash_ofs, d, data_size)!=0)return(-1);
+vec=(const LIBMVL_VECTOR *)&(d[hash_ofs]);
+if(mvl_vector_type(vec)!=LIBMVL_VECTOR_INT32 && mvl_vector_type(vec)!=LIBMVL_VECTOR_INT64)return(-1);
+
+n=L->free;
+if(mvl_vector_length(vec)<n+1)return(-1);
+
+/* Tables built with a different hash function would not find existing entries */
+v=(mvl_vector_type(vec)==LIBMVL_VECTOR_INT32) ? mvl_vector_data_int32(vec)[0] : mvl_vector_data_int64(vec)[0];
+if(v!=LIBMVL_NAMED_LIST_HASH_VERSION)return(-1);
+
+hs=mvl_vector_length(vec)-n-1;
+if(hs<L->size || (hs & (hs-1)))return(-1);
+
+free(L->next_item);
+free(L->first_item);
+L->hash_size=hs;
+L->next_item=do_malloc(hs, sizeof(*L->next_item));
+L->first_item=do_malloc(hs, sizeof(*L->first_item));
+
+/* Entries are chained in decreasing order, which guarantees that lookups terminate */
+for(i=0;i<hs+n;i++) {
+	v=(mvl_vector_type(vec)==LIBMVL_VECTOR_INT32) ? mvl_vector_data_int32(vec)[i+1] : mvl_vector_data_int64(vec)[i+1];
+	if(v<-1 || v>=(long long)(i<hs ? n : i-hs)) {
+		L->hash_size=0;
+		return(-1);
+		}
+	if(i<hs)L->first_item[i]=v;
+		else L->next_item[i-hs]=v;
+	}
+
+/* Spot check that chain heads are placed in their buckets, a stale table is recomputed */
+step=hs/LIBMVL_NAMED_LIST_HASH_SAMPLES;
+if(step<1)step=1;
+for(i=0;i<hs;i+=step) {
+	v=L->first_item[i];
+	if(v<0)continue;
+	if((mvl_accumulate_hash64(MVL_SEED_HASH_VALUE, L->tag[v], L->tag_length[v]) & (hs-1))!=i) {
+		L->hash_size=0;
+		return(-1);
+		}
+	}
+return(0);
+}
+
 /* This is meant to operate on memory mapped files */
-/*! @brief Read back MVL attributes list, typically used to described metadata. This function also initialize hash table for fast access. This function does not check that the offsets stored in returned LIBMVL_NAMED_LIST data structure are valid, this should be done by the code that uses those offsets.
+/*! @brief Read back MVL attributes list without copying tags. Same as mvl_read_attributes_list(), except that the returned list references tags in data, which must remain valid while the list is used, see mvl_named_list_copy_tags().
  *   @param ctx MVL context pointer
  *   @param data memory mapped data. If data is NULL then this function will use base address from context initialized by mvl_load_image()
  *   @param data_size size of memory mapped data. If data is NULL then this function will use data_size from context initialized by mvl_load_image()
  *   @param metadata_offset metadata offset pointing to the previously written attributes
  *   @return NULL if there is no metadata, otherwise LIBMVL_NAMED_LIST populated with attributes
  */
-LIBMVL_NAMED_LIST *mvl_read_attributes_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 metadata_offset)
+LIBMVL_NAMED_LIST *mvl_read_attributes_list_view(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 metadata_offset)
 {
 LIBMVL_NAMED_LIST *L;
 long i, nattr;
@@ -1620,37 +2499,52 @@ L=mvl_create_named_list(nattr);
 for(i=0;i<nattr;i++) {
 	if((err=mvl_validate_vector(mvl_vector_data_offset(p)[i], data, data_size))!=0) {
 		mvl_set_error(ctx, LIBMVL_ERR_INVALID_OFFSET);
-		mvl_add_list_entry(L, 
-			9, 
-			"*CORRUPT*", 
-			mvl_vector_data_offset(p)[i+nattr]);
+		mvl_set_list_view_entry(L, i, 9, "*CORRUPT*", mvl_vector_data_offset(p)[i+nattr]);
 		} else {
-		mvl_add_list_entry(L, 
+		mvl_set_list_view_entry(L, i,
 			mvl_vector_length(&(d[mvl_vector_data_offset(p)[i]])), 
 			(const char *)mvl_vector_data_uint8(&(d[mvl_vector_data_offset(p)[i]])), 
 			mvl_vector_data_offset(p)[i+nattr]);
 		}
 	}
+L->free=nattr;
+L->external_tags=nattr;
 
+/* Build hash table before returning, so that lookups do not modify the list */
 mvl_recompute_named_list_hash(L);
 return(L);
 }
 
+/*! @brief Read back MVL attributes list, typically used to described metadata. Hash table for fast access is computed before the list is returned. This function does not check that the offsets stored in returned LIBMVL_NAMED_LIST data structure are valid, this should be done by the code that uses those offsets.
+ *   @param ctx MVL context pointer
+ *   @param data memory mapped data. If data is NULL then this function will use base address from context initialized by mvl_load_image()
+ *   @param data_size size of memory mapped data. If data is NULL then this function will use data_size from context initialized by mvl_load_image()
+ *   @param metadata_offset metadata offset pointing to the previously written attributes
+ *   @return NULL if there is no metadata, otherwise LIBMVL_NAMED_LIST populated with attributes
+ */
+LIBMVL_NAMED_LIST *mvl_read_attributes_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 metadata_offset)
+{
+LIBMVL_NAMED_LIST *L;
+L=mvl_read_attributes_list_view(ctx, data, data_size, metadata_offset);
+if(L!=NULL)mvl_named_list_copy_tags(L);
+return(L);
+}
+
 /* This is meant to operate on memory mapped files */
-/*! @brief Read back MVL named list. This function also initialize hash table for fast access.
+/*! @brief Read back MVL named list without copying tags. Same as mvl_read_named_list(), except that the returned list references tags in data, which must remain valid while the list is used, see mvl_named_list_copy_tags().
  *   @param ctx MVL context pointer
  *   @param data memory mapped data. If data is NULL then this function will use base address from context initialized by mvl_load_image()
- *   @param data_size size of memory mapped data. ggIf data is NULL then this function will use data_size from context initialized by mvl_load_image()
+ *   @param data_size size of memory mapped data. If data is NULL then this function will use data_size from context initialized by mvl_load_image()
  *   @param offset offset into data where LIBMVL_NAMED_LIST begins
  *   @return NULL on error, otherwise LIBMVL_NAMED_LIST
  */
-LIBMVL_NAMED_LIST *mvl_read_named_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 offset)
+LIBMVL_NAMED_LIST *mvl_read_named_list_view(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 offset)
 {
 LIBMVL_NAMED_LIST *L, *Lattr;
 char *d;
 LIBMVL_OFFSET64 names_ofs, tag_ofs;
 long i, nelem;
-int err;
+int err, corrupt;
 
 if(offset==LIBMVL_NULL_OFFSET)return(NULL);
 
@@ -1677,7 +2571,7 @@ if(mvl_vector_type(&(d[offset]))!=LIBMVL_VECTOR_OFFSET64){
 	return(NULL);
 	}
 
-Lattr=mvl_read_attributes_list(ctx, data, data_size, mvl_vector_metadata_offset(&(d[offset])));
+Lattr=mvl_read_attributes_list_view(ctx, data, data_size, mvl_vector_metadata_offset(&(d[offset])));
 if(Lattr==NULL)return(NULL);
 names_ofs=mvl_find_list_entry(Lattr, -1, "names");
 
@@ -1689,6 +2583,7 @@ if((err=mvl_validate_vector(names_ofs, data, data_size))!=0) {
 nelem=mvl_vector_length(&(d[offset]));
 
 L=mvl_create_named_list(nelem);
+corrupt=0;
 
 switch(mvl_vector_type(&(d[names_ofs]))) {
 	case LIBMVL_VECTOR_OFFSET64:
@@ -1703,11 +2598,12 @@ switch(mvl_vector_type(&(d[names_ofs]))) {
 			
 			if((err=mvl_validate_vector(tag_ofs, data, data_size))!=0) {
 				mvl_set_error(ctx, LIBMVL_ERR_INVALID_OFFSET);
-				mvl_add_list_entry(L, 9, "*CORRUPT*", mvl_vector_data_offset(&(d[offset]))[i]);
+				mvl_set_list_view_entry(L, i, 9, "*CORRUPT*", mvl_vector_data_offset(&(d[offset]))[i]);
+				corrupt=1;
 				continue;
 				}
 				
-			mvl_add_list_entry(L, mvl_vector_length(&(d[tag_ofs])), (const char *)mvl_vector_data_uint8(&(d[tag_ofs])), mvl_vector_data_offset(&(d[offset]))[i]);
+			mvl_set_list_view_entry(L, i, mvl_vector_length(&(d[tag_ofs])), (const char *)mvl_vector_data_uint8(&(d[tag_ofs])), mvl_vector_data_offset(&(d[offset]))[i]);
 			}
 		break;
 	case LIBMVL_PACKED_LIST64:
@@ -1720,10 +2616,11 @@ switch(mvl_vector_type(&(d[names_ofs]))) {
 		for(i=0;i<nelem;i++) {
 			if((err=mvl_packed_list_validate_entry((LIBMVL_VECTOR *)&(d[names_ofs]), d, data_size, i))!=0) {
 				mvl_set_error(ctx, LIBMVL_ERR_CORRUPT_PACKED_LIST);
-				mvl_add_list_entry(L, 9, "*CORRUPT*", mvl_vector_data_offset(&(d[offset]))[i]);
+				mvl_set_list_view_entry(L, i, 9, "*CORRUPT*", mvl_vector_data_offset(&(d[offset]))[i]);
+				corrupt=1;
 				continue;
 				}
-			mvl_add_list_entry(L, mvl_packed_list_get_entry_bytelength((LIBMVL_VECTOR *)&(d[names_ofs]), i), (const char *)mvl_packed_list_get_entry((LIBMVL_VECTOR *)&(d[names_ofs]), d, i), mvl_vector_data_offset(&(d[offset]))[i]);
+			mvl_set_list_view_entry(L, i, mvl_packed_list_get_entry_bytelength((LIBMVL_VECTOR *)&(d[names_ofs]), i), (const char *)mvl_packed_list_get_entry((LIBMVL_VECTOR *)&(d[names_ofs]), d, i), mvl_vector_data_offset(&(d[offset]))[i]);
 			}
 		break;
 	default:
@@ -1733,9 +2630,30 @@ switch(mvl_vector_type(&(d[names_ofs]))) {
 		return(NULL);
 	}
 
+L->free=nelem;
+L->external_tags=nelem;
+
+/* Substituted tags do not match stored hashes */
+if(corrupt || mvl_load_named_list_hash(L, d, data_size, mvl_find_list_entry(Lattr, -1, LIBMVL_NAMED_LIST_HASH_ATTRIBUTE)))
+	mvl_recompute_named_list_hash(L);
+
 mvl_free_named_list(Lattr);
+return(L);
+}
 
-mvl_recompute_named_list_hash(L);
+/*! @brief Read back MVL named list. 
+ *   Hash table for fast access is loaded from the file if it was stored by mvl_write_named_list(), otherwise it is computed.
+ *   @param ctx MVL context pointer
+ *   @param data memory mapped data. If data is NULL then this function will use base address from context initialized by mvl_load_image()
+ *   @param data_size size of memory mapped data. If data is NULL then this function will use data_size from context initialized by mvl_load_image()
+ *   @param offset offset into data where LIBMVL_NAMED_LIST begins
+ *   @return NULL on error, otherwise LIBMVL_NAMED_LIST
+ */
+LIBMVL_NAMED_LIST *mvl_read_named_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 offset)
+{
+LIBMVL_NAMED_LIST *L;
+L=mvl_read_named_list_view(ctx, data, data_size, offset);
+if(L!=NULL)mvl_named_list_copy_tags(L);
 return(L);
 }
 
@@ -1745,26 +2663,113 @@ return(L);
  */
 void mvl_open(LIBMVL_CONTEXT *ctx, FILE *f)
 {
+off_t offset;
 ctx->f=f;
+/* The file position is only queried once, afterwards it is tracked by mvl_write() */
+offset=do_ftello(f);
+ctx->write_offset=offset<0 ? 0 : offset;
+if(ctx->write_buffer==NULL && ctx->write_buffer_size>0)ctx->write_buffer=do_malloc(ctx->write_buffer_size, 1);
+ctx->write_buffer_used=0;
+/* Streaming checksums requested before opening the file start with the preamble */
+if(ctx->stream_checksum_block_size>0 && ctx->stream_hashes_count==0 && ctx->stream_block_used==0)ctx->stream_checksum_start=ctx->write_offset;
 mvl_write_preamble(ctx);
 }
 
-/*! @brief Write out MVL file directory and postable and close file
+/*! @brief Prepare context for appending to existing MVL file f. The directory of the file is loaded, so that entries added with mvl_add_directory_entry() extend it. 
+ *   New vectors are written after the end of the file, and mvl_close() writes a new directory and postamble that supersede the old ones.
+ *   Existing data is not modified, so programs that have the file memory mapped keep seeing the old directory until they map the file again.
+ *   Vectors written previously can be referenced by offsets found in the old directory.
  *   @param ctx MVL context pointer
+ *   @param f pointer to stdio.h FILE structure, opened for reading and writing, for example with fopen(name, "r+")
+ *   @return 0 if everything went well, otherwise a negative error code
  */
-void mvl_close(LIBMVL_CONTEXT *ctx)
+int mvl_open_append(LIBMVL_CONTEXT *ctx, FILE *f)
 {
-mvl_write_directory(ctx);
-mvl_write_postamble(ctx);
-fflush(ctx->f);
-ctx->f=NULL;
-}
+#ifndef __WIN32__
+LIBMVL_PREAMBLE *pr;
+LIBMVL_OFFSET64 length, padding;
+unsigned char *zeros;
+void *data;
+off_t end;
 
-LIBMVL_OFFSET64 mvl_directory_length(const void *data)
-{
-LIBMVL_VECTOR_HEADER *p=(LIBMVL_VECTOR_HEADER *)data;
-if(p->type!=LIBMVL_VECTOR_OFFSET64) {
-	return(0);
+if(fseeko(f, 0, SEEK_END)<0) {
+	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_SEEK);
+	return(LIBMVL_ERR_CANNOT_SEEK);
+	}
+end=do_ftello(f);
+if(end<0) {
+	mvl_set_error(ctx, LIBMVL_ERR_FTELL);
+	return(LIBMVL_ERR_FTELL);
+	}
+length=end;
+if(length<sizeof(LIBMVL_PREAMBLE)+sizeof(LIBMVL_POSTAMBLE)) {
+	mvl_set_error(ctx, LIBMVL_ERR_MVL_FILE_TOO_SHORT);
+	return(LIBMVL_ERR_MVL_FILE_TOO_SHORT);
+	}
+
+/* Load directory from a temporary map */
+data=mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(f), 0);
+if(data==MAP_FAILED) {
+	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_MAP);
+	return(LIBMVL_ERR_CANNOT_MAP);
+	}
+
+ctx->error=0;
+mvl_load_image(ctx, data, length);
+pr=(LIBMVL_PREAMBLE *)data;
+if(ctx->error==0)ctx->alignment=pr->alignment;
+ctx->data=NULL;
+ctx->data_size=0;
+/* Directory tags point into the map */
+mvl_named_list_copy_tags(ctx->directory);
+munmap(data, length);
+if(ctx->error!=0)return(ctx->error);
+
+/* Streaming checksums requested before opening the file start with the appended data */
+if(ctx->stream_checksum_block_size>0 && ctx->stream_hashes_count==0 && ctx->stream_block_used==0) {
+	if(length & 0x7) {
+		mvl_set_error(ctx, LIBMVL_ERR_UNALIGNED_OFFSET);
+		return(LIBMVL_ERR_UNALIGNED_OFFSET);
+		}
+	ctx->stream_checksum_start=length;
+	}
+
+ctx->f=f;
+ctx->write_offset=length;
+if(ctx->write_buffer==NULL && ctx->write_buffer_size>0)ctx->write_buffer=do_malloc(ctx->write_buffer_size, 1);
+ctx->write_buffer_used=0;
+
+/* Keep new vectors aligned */
+padding=(ctx->alignment-(length & (ctx->alignment-1))) & (ctx->alignment-1);
+if(padding>0) {
+	zeros=alloca(padding);
+	memset(zeros, 0, padding);
+	mvl_write(ctx, padding, zeros);
+	}
+return(0);
+#else
+mvl_set_error(ctx, LIBMVL_ERR_CANNOT_MAP);
+return(LIBMVL_ERR_CANNOT_MAP);
+#endif
+}
+
+/*! @brief Write out MVL file directory and postable and close file
+ *   @param ctx MVL context pointer
+ */
+void mvl_close(LIBMVL_CONTEXT *ctx)
+{
+mvl_write_directory(ctx);
+mvl_write_postamble(ctx);
+mvl_flush_write_buffer(ctx);
+fflush(ctx->f);
+ctx->f=NULL;
+}
+
+LIBMVL_OFFSET64 mvl_directory_length(const void *data)
+{
+LIBMVL_VECTOR_HEADER *p=(LIBMVL_VECTOR_HEADER *)data;
+if(p->type!=LIBMVL_VECTOR_OFFSET64) {
+	return(0);
 	}
 if(p->length &1) {
 	return 0;
@@ -1799,7 +2804,7 @@ LIBMVL_OFFSET64 mvl_find_directory_entry(LIBMVL_CONTEXT *ctx, const char *tag)
 return(mvl_find_list_entry(ctx->directory, -1, tag));
 }
 
-/*! @brief Initilize MVL context to operate with memory mapped area data.
+/*! @brief Initilize MVL context to operate with memory mapped area data. Directory tags point into data, which must stay mapped while the context is used.
  *   @param ctx MVL context pointer
  *   @param data pointer to the beginning of memory mapped area
  *   @param length size of memory mapped data, in bytes
@@ -1813,6 +2818,15 @@ LIBMVL_OFFSET64 k;
 int i;
 int err;
 
+/* The directory references the previous image, drop it before this one can be rejected */
+mvl_free_named_list(ctx->directory);
+ctx->directory=mvl_create_named_list(100);
+
+if(length<sizeof(LIBMVL_POSTAMBLE)+sizeof(LIBMVL_PREAMBLE)) {
+	mvl_set_error(ctx, LIBMVL_ERR_MVL_FILE_TOO_SHORT);
+	return;
+	}
+
 if(strncmp(pr->signature, LIBMVL_SIGNATURE, 4)) {
 	mvl_set_error(ctx, LIBMVL_ERR_INVALID_SIGNATURE);
 	return;
@@ -1822,11 +2836,6 @@ if(pr->endianness!=LIBMVL_ENDIANNESS_FLAG) {
 	mvl_set_error(ctx, LIBMVL_ERR_WRONG_ENDIANNESS);
 	return;
 	}
-	
-if(length<sizeof(LIBMVL_POSTAMBLE)+sizeof(LIBMVL_PREAMBLE)) {
-	mvl_set_error(ctx, LIBMVL_ERR_MVL_FILE_TOO_SHORT);
-	return;
-	}
 
 //fprintf(stderr, "Reading MVL directory at offset 0x%08llx\n", pa->directory);
 
@@ -1843,7 +2852,8 @@ switch(pa->type) {
 			return;
 			}
 
-		ctx->directory=mvl_read_named_list(ctx, data, length, pa->directory);
+		/* Directory tags reference the mapped data, which stays valid while it is in use */
+		ctx->directory=mvl_read_named_list_view(ctx, data, length, pa->directory);
 		if(ctx->directory==NULL)
 			ctx->directory=mvl_create_named_list(100);
 		break;
@@ -1892,6 +2902,281 @@ if((ctx->full_checksums_offset!=LIBMVL_NULL_OFFSET) && (err=mvl_validate_vector(
 	mvl_set_error(ctx, err);
 	ctx->full_checksums_offset=LIBMVL_NULL_OFFSET;
 	}
+
+/* Blocks verified in a previous image are not known to be valid */
+mvl_reset_verified_blocks(ctx);
+}
+
+#ifndef __WIN32__
+/* Apply madvise() to a range of the memory map, extending it to page boundaries */
+static int mvl_advise_range(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, int advice)
+{
+LIBMVL_OFFSET64 page_size;
+
+if(ctx->mapping==NULL)return(0);
+if(stop>ctx->mapping_length)stop=ctx->mapping_length;
+if(start>=stop)return(0);
+
+page_size=sysconf(_SC_PAGESIZE);
+start-=start % page_size;
+
+if(madvise(&(((unsigned char *)ctx->mapping)[start]), stop-start, advice)<0)return(LIBMVL_ERR_INVALID_PARAMETER);
+return(0);
+}
+#endif
+
+/*! @brief Memory map MVL file and initialize the context to access it. The mapping is owned by the context and released with mvl_free_context(). 
+ *  This replaces the sequence of open, mmap and mvl_load_image() calls, and allows to describe expected access pattern.
+ * 
+ *  Vector data is accessed via ctx->data, and the size of the file is ctx->data_size.
+ *  When the context already maps a file, it is released only after the new file has been loaded. If loading fails, the previous file stays accessible.
+ * 
+ *  @param ctx MVL context pointer that is not used for writing
+ *  @param path the name of MVL file
+ *  @param flags a combination of LIBMVL_MAP_SEQUENTIAL, LIBMVL_MAP_RANDOM, LIBMVL_MAP_WILLNEED, LIBMVL_MAP_POPULATE and LIBMVL_MAP_HUGEPAGES, or 0 for defaults
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_open_mapped(LIBMVL_CONTEXT *ctx, const char *path, int flags)
+{
+#ifndef __WIN32__
+struct stat st;
+void *data;
+int fd, map_flags, err;
+LIBMVL_NAMED_LIST *old_directory;
+unsigned char *old_data;
+LIBMVL_OFFSET64 old_data_size, old_full_checksums_offset;
+
+fd=open(path, O_RDONLY);
+if(fd<0) {
+	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_OPEN);
+	return(LIBMVL_ERR_CANNOT_OPEN);
+	}
+
+if(fstat(fd, &st)<0) {
+	close(fd);
+	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_OPEN);
+	return(LIBMVL_ERR_CANNOT_OPEN);
+	}
+
+if((LIBMVL_OFFSET64)st.st_size<sizeof(LIBMVL_PREAMBLE)+sizeof(LIBMVL_POSTAMBLE)) {
+	close(fd);
+	mvl_set_error(ctx, LIBMVL_ERR_MVL_FILE_TOO_SHORT);
+	return(LIBMVL_ERR_MVL_FILE_TOO_SHORT);
+	}
+
+map_flags=MAP_SHARED;
+#ifdef MAP_POPULATE
+if(flags & LIBMVL_MAP_POPULATE)map_flags|=MAP_POPULATE;
+#endif
+
+data=mmap(NULL, st.st_size, PROT_READ, map_flags, fd, 0);
+/* The mapping does not need the file descriptor */
+close(fd);
+if(data==MAP_FAILED) {
+	mvl_set_error(ctx, LIBMVL_ERR_CANNOT_MAP);
+	return(LIBMVL_ERR_CANNOT_MAP);
+	}
+
+/* Keep the previous image until the new one is loaded */
+old_directory=ctx->directory;
+old_data=ctx->data;
+old_data_size=ctx->data_size;
+old_full_checksums_offset=ctx->full_checksums_offset;
+ctx->directory=mvl_create_named_list(100);
+
+ctx->error=0;
+mvl_load_image(ctx, data, st.st_size);
+if(ctx->error!=0) {
+	err=ctx->error;
+	mvl_free_named_list(ctx->directory);
+	ctx->directory=old_directory;
+	ctx->data=old_data;
+	ctx->data_size=old_data_size;
+	ctx->full_checksums_offset=old_full_checksums_offset;
+	mvl_reset_verified_blocks(ctx);
+	munmap(data, st.st_size);
+	ctx->error=err;
+	return(err);
+	}
+
+mvl_free_named_list(old_directory);
+if(ctx->mapping!=NULL)munmap(ctx->mapping, ctx->mapping_length);
+ctx->mapping=data;
+ctx->mapping_length=st.st_size;
+
+/* Hints are advisory, so failures are ignored */
+if(flags & LIBMVL_MAP_SEQUENTIAL)mvl_advise_range(ctx, 0, st.st_size, MADV_SEQUENTIAL);
+if(flags & LIBMVL_MAP_RANDOM)mvl_advise_range(ctx, 0, st.st_size, MADV_RANDOM);
+if(flags & LIBMVL_MAP_WILLNEED)mvl_advise_range(ctx, 0, st.st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+if(flags & LIBMVL_MAP_HUGEPAGES)mvl_advise_range(ctx, 0, st.st_size, MADV_HUGEPAGE);
+#endif
+
+return(0);
+#else
+mvl_set_error(ctx, LIBMVL_ERR_CANNOT_MAP);
+return(LIBMVL_ERR_CANNOT_MAP);
+#endif
+}
+
+#ifndef __WIN32__
+/* Compute byte ranges occupied by a vector. Packed lists have a second range with string data. Returns the number of ranges or a negative error code */
+static int mvl_vector_ranges(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_OFFSET64 *ranges)
+{
+LIBMVL_VECTOR *vec;
+int err;
+
+if(ctx->mapping==NULL || ctx->data==NULL)return(LIBMVL_ERR_NO_DATA);
+if((err=mvl_validate_vector(offset, ctx->data, ctx->data_size))<0)return(err);
+
+vec=(LIBMVL_VECTOR *)&(ctx->data[offset]);
+ranges[0]=offset;
+ranges[1]=offset+sizeof(LIBMVL_VECTOR_HEADER)+mvl_vector_length(vec)*mvl_element_size(mvl_vector_type(vec));
+
+if(mvl_vector_type(vec)!=LIBMVL_PACKED_LIST64 || mvl_vector_length(vec)<2)return(1);
+
+ranges[2]=mvl_vector_data_offset(vec)[0];
+ranges[3]=mvl_vector_data_offset(vec)[mvl_vector_length(vec)-1];
+return(2);
+}
+#endif
+
+/*! @brief Describe expected access to a single vector of a file opened with mvl_open_mapped(). 
+ *  The advice covers the vector header and data, and, for LIBMVL_PACKED_LIST64 vectors, the string data they point to. 
+ *  This is useful, for example, to start loading a few columns of a large table before they are scanned.
+ * 
+ *  @param ctx MVL context pointer initialized with mvl_open_mapped()
+ *  @param offset offset of the vector, as obtained from the directory or a named list
+ *  @param advice one of LIBMVL_ADVISE_NORMAL, LIBMVL_ADVISE_SEQUENTIAL, LIBMVL_ADVISE_RANDOM, LIBMVL_ADVISE_WILLNEED or LIBMVL_ADVISE_DONTNEED
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_advise_vector(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, int advice)
+{
+#ifndef __WIN32__
+LIBMVL_OFFSET64 ranges[4];
+int i, n, err, madv;
+
+switch(advice) {
+	case LIBMVL_ADVISE_NORMAL:
+		madv=MADV_NORMAL;
+		break;
+	case LIBMVL_ADVISE_SEQUENTIAL:
+		madv=MADV_SEQUENTIAL;
+		break;
+	case LIBMVL_ADVISE_RANDOM:
+		madv=MADV_RANDOM;
+		break;
+	case LIBMVL_ADVISE_WILLNEED:
+		madv=MADV_WILLNEED;
+		break;
+	case LIBMVL_ADVISE_DONTNEED:
+		madv=MADV_DONTNEED;
+		break;
+	default:
+		return(LIBMVL_ERR_INVALID_PARAMETER);
+	}
+
+if((n=mvl_vector_ranges(ctx, offset, ranges))<0)return(n);
+for(i=0;i<n;i++) {
+	if((err=mvl_advise_range(ctx, ranges[2*i], ranges[2*i+1], madv))<0)return(err);
+	}
+return(0);
+#else
+return(0);
+#endif
+}
+
+/*! @brief Start loading several vectors of a file opened with mvl_open_mapped() in the background. This is convenient to warm up the columns used by a query before the scan begins.
+ * 
+ *  @param ctx MVL context pointer initialized with mvl_open_mapped()
+ *  @param count the number of vectors
+ *  @param offsets an array of vector offsets, LIBMVL_NULL_OFFSET entries are skipped
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_prefetch_vectors(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *offsets)
+{
+LIBMVL_OFFSET64 i;
+int err;
+
+for(i=0;i<count;i++) {
+	if(offsets[i]==LIBMVL_NULL_OFFSET)continue;
+	if((err=mvl_advise_vector(ctx, offsets[i], LIBMVL_ADVISE_WILLNEED))<0)return(err);
+	}
+return(0);
+}
+
+/*! @brief Start loading vectors referenced by a named list, such as columns of a data frame, in the background
+ * 
+ *  @param ctx MVL context pointer initialized with mvl_open_mapped()
+ *  @param L a named list read with mvl_read_named_list()
+ *  @param count the number of names, or 0 to load all entries
+ *  @param names an array of entry names. Names not present in the list are skipped
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_prefetch_list_entries(LIBMVL_CONTEXT *ctx, LIBMVL_NAMED_LIST *L, LIBMVL_OFFSET64 count, const char **names)
+{
+LIBMVL_OFFSET64 i, offset;
+int err;
+
+if(count==0)return(mvl_prefetch_vectors(ctx, L->free, L->offset));
+
+for(i=0;i<count;i++) {
+	offset=mvl_find_list_entry(L, -1, names[i]);
+	if(offset==LIBMVL_NULL_OFFSET)continue;
+	if((err=mvl_advise_vector(ctx, offset, LIBMVL_ADVISE_WILLNEED))<0)return(err);
+	}
+return(0);
+}
+
+/* Number of pages queried by a single call to mincore() */
+#ifndef LIBMVL_RESIDENCY_PAGES
+#define LIBMVL_RESIDENCY_PAGES	4096
+#endif
+
+/*! @brief Find which portion of a vector of a file opened with mvl_open_mapped() is currently in memory. Schedulers can use this to favor queries over columns that are already loaded.
+ *  For LIBMVL_PACKED_LIST64 vectors the string data is included.
+ * 
+ *  @param ctx MVL context pointer initialized with mvl_open_mapped()
+ *  @param offset offset of the vector
+ *  @param fraction receives the fraction of vector pages that are resident in memory, from 0 to 1
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_vector_residency(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, double *fraction)
+{
+#ifndef __WIN32__
+unsigned char residency[LIBMVL_RESIDENCY_PAGES];
+LIBMVL_OFFSET64 ranges[4];
+LIBMVL_OFFSET64 page_size, start, stop, len, pos, pages, resident, total, k;
+int i, n;
+
+*fraction=0.0;
+if((n=mvl_vector_ranges(ctx, offset, ranges))<0)return(n);
+
+page_size=sysconf(_SC_PAGESIZE);
+resident=0;
+total=0;
+for(i=0;i<n;i++) {
+	start=ranges[2*i];
+	stop=ranges[2*i+1];
+	if(stop>ctx->mapping_length)stop=ctx->mapping_length;
+	if(start>=stop)continue;
+	start-=start % page_size;
+	
+	for(pos=start;pos<stop;pos+=len) {
+		len=stop-pos;
+		if(len>LIBMVL_RESIDENCY_PAGES*page_size)len=LIBMVL_RESIDENCY_PAGES*page_size;
+		pages=(len+page_size-1)/page_size;
+		if(mincore(&(((unsigned char *)ctx->mapping)[pos]), len, (void *)residency)<0)return(LIBMVL_ERR_INVALID_PARAMETER);
+		for(k=0;k<pages;k++)resident+=residency[k] & 1;
+		total+=pages;
+		}
+	}
+if(total>0)*fraction=(double)resident/total;
+return(0);
+#else
+*fraction=1.0;
+return(0);
+#endif
 }
 
 typedef struct {
@@ -2294,92 +3579,204 @@ return 0;
 }
 #endif
 
-/*! @brief This function is used to compute 64 bit hash of vector values
- * array hash[] is passed in and contains the result of the computation
- * 
- * Integer indices are computed by value, so that 100 produces the same hash whether it is stored as INT32 or INT64.
- * 
- * Floats and doubles are trickier - we can guarantee that the hash of a float promoted to a double is the same as the hash of the original float, but not the reverse.
- * 
- * @param indices_count  total number of indices 
- * @param indices an array of indices into provided vectors
- * @param hash a previously allocated array of length indices_count that the computed hashes will be written into
- * @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
- * @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
- * @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL files
- * @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from. 
- * @param flags flags specifying whether to initialize or finalize hash
+/* Hashing is done in blocks of LIBMVL_HASH_BLOCK rows, so that hash values stay in cache while all columns are processed. 
+ * Large inputs are split among threads by block.
  */
-int mvl_hash_indices(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, int flags)
+#ifndef LIBMVL_HASH_BLOCK
+#define LIBMVL_HASH_BLOCK	1024
+#endif
+
+#ifndef LIBMVL_PARALLEL_HASH_THRESHOLD
+#define LIBMVL_PARALLEL_HASH_THRESHOLD	(1LLU<<16)
+#endif
+
+/* The hash of each row is an independent chain, so the kernels below can advance several rows at once in SIMD registers. 
+ * With GCC on x86-64 Linux we compile AVX2 and AVX-512 variants, and the one suitable for the CPU is selected at runtime.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__) && !defined(LIBMVL_NO_TARGET_CLONES)
+#define LIBMVL_HASH_KERNEL __attribute__((target_clones("avx512f", "avx2", "default"), optimize("tree-vectorize")))
+#else
+#define LIBMVL_HASH_KERNEL
+#endif
+
+/* mvl_accumulate_*_hash64() access 64-bit values as two 32-bit words through a pointer, which prevents vectorization. 
+ * These macros extract the same words with shifts, so that the hashes are identical. 
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define MVL_HASH_WORD0(u)	((u)>>32)
+#define MVL_HASH_WORD1(u)	((u) & 0xffffffffLLU)
+#define MVL_HASH_BYTE(u, k)	(((u)>>(56-8*(k))) & 0xff)
+#else
+#define MVL_HASH_WORD0(u)	((u) & 0xffffffffLLU)
+#define MVL_HASH_WORD1(u)	((u)>>32)
+#define MVL_HASH_BYTE(u, k)	(((u)>>(8*(k))) & 0xff)
+#endif
+
+static inline LIBMVL_OFFSET64 mvl_hash_step(LIBMVL_OFFSET64 x, LIBMVL_OFFSET64 w)
 {
-LIBMVL_OFFSET64 i, j, N;
+x+=w;
+x*=13397683724573242421LLU;
+x^=x>>33;
+return(x);
+}
 
-if(flags & LIBMVL_INIT_HASH) {
-	for(i=0;i<indices_count;i++) {
-		hash[i]=MVL_SEED_HASH_VALUE;
+static inline LIBMVL_OFFSET64 mvl_hash_step64(LIBMVL_OFFSET64 x, LIBMVL_OFFSET64 u)
+{
+return(mvl_hash_step(mvl_hash_step(x, MVL_HASH_WORD0(u)), MVL_HASH_WORD1(u)));
+}
+
+/* The kernels hash data[indices[i]] into hash[i], or data[i] if indices is NULL */
+static LIBMVL_HASH_KERNEL void mvl_hash_uint8_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const unsigned char *data)
+{
+LIBMVL_OFFSET64 i;
+if(indices==NULL) {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step(hash[i], data[i]);
+	} else {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step(hash[i], data[indices[i]]);
+	}
+}
+
+static LIBMVL_HASH_KERNEL void mvl_hash_int32_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const int *data)
+{
+LIBMVL_OFFSET64 i;
+if(indices==NULL) {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step64(hash[i], (LIBMVL_OFFSET64)(long long int)data[i]);
+	} else {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step64(hash[i], (LIBMVL_OFFSET64)(long long int)data[indices[i]]);
+	}
+}
+
+static LIBMVL_HASH_KERNEL void mvl_hash_int64_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const long long int *data)
+{
+LIBMVL_OFFSET64 i;
+if(indices==NULL) {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step64(hash[i], (LIBMVL_OFFSET64)data[i]);
+	} else {
+	for(i=0;i<count;i++)hash[i]=mvl_hash_step64(hash[i], (LIBMVL_OFFSET64)data[indices[i]]);
+	}
+}
+
+/* Floats are hashed as doubles, so that a float promoted to double has the same hash */
+static LIBMVL_HASH_KERNEL void mvl_hash_float_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const float *data)
+{
+LIBMVL_OFFSET64 i, u;
+double d;
+if(indices==NULL) {
+	for(i=0;i<count;i++) {
+		d=data[i];
+		memcpy(&u, &d, sizeof(u));
+		hash[i]=mvl_hash_step64(hash[i], u);
+		}
+	} else {
+	for(i=0;i<count;i++) {
+		d=data[indices[i]];
+		memcpy(&u, &d, sizeof(u));
+		hash[i]=mvl_hash_step64(hash[i], u);
 		}
 	}
+}
 
-if(vec_count<1)return 0;
+static LIBMVL_HASH_KERNEL void mvl_hash_double_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const double *data)
+{
+LIBMVL_OFFSET64 i, u;
+if(indices==NULL) {
+	for(i=0;i<count;i++) {
+		memcpy(&u, &(data[i]), sizeof(u));
+		hash[i]=mvl_hash_step64(hash[i], u);
+		}
+	} else {
+	for(i=0;i<count;i++) {
+		memcpy(&u, &(data[indices[i]]), sizeof(u));
+		hash[i]=mvl_hash_step64(hash[i], u);
+		}
+	}
+}
 
-N=mvl_vector_length(vec[0]);
-//fprintf(stderr, "vec_count=%d N=%d\n", vec_count, N);
-if(mvl_vector_type(vec[0])==LIBMVL_PACKED_LIST64)N--;
-for(i=1;i<vec_count;i++) {
-	if(mvl_vector_type(vec[i])==LIBMVL_PACKED_LIST64) {
-		if(mvl_vector_length(vec[i])!=N+1)return -1;
-		if(vec_data==NULL)return -2;
-		if(vec_data[i]==NULL)return -3;
-		continue;
+/* Offsets are hashed byte by byte */
+static LIBMVL_HASH_KERNEL void mvl_hash_offset64_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, const LIBMVL_OFFSET64 *data)
+{
+LIBMVL_OFFSET64 i, u, x;
+int k;
+for(i=0;i<count;i++) {
+	u=(indices==NULL) ? data[i] : data[indices[i]];
+	x=hash[i];
+	for(k=0;k<8;k++)x=mvl_hash_step(x, MVL_HASH_BYTE(u, k));
+	hash[i]=x;
+	}
+}
+
+/* Strings have different lengths. Groups of 8 rows are advanced together over their common length with mvl_accumulate_hash64x8(), 
+ * then each row is finished separately. 
+ */
+static int mvl_hash_packed_list64_kernel(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 *hash, LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 data_length)
+{
+LIBMVL_OFFSET64 i, k, m, row, len[8];
+const unsigned char *d[8];
+
+for(i=0;i<count;i++) {
+	row=(indices==NULL) ? i+i0 : indices[i];
+	if(mvl_packed_list_validate_entry(vec, data, data_length, row))return -8;
+	}
+
+for(i=0;i+8<=count;i+=8) {
+	m=0;
+	for(k=0;k<8;k++) {
+		row=(indices==NULL) ? i+k+i0 : indices[i+k];
+		d[k]=mvl_packed_list_get_entry(vec, data, row);
+		len[k]=mvl_packed_list_get_entry_bytelength(vec, row);
+		if(k==0 || len[k]<m)m=len[k];
+		}
+	mvl_accumulate_hash64x8(&(hash[i]), d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7], m);
+	for(k=0;k<8;k++) {
+		if(len[k]>m)hash[i+k]=mvl_accumulate_hash64(hash[i+k], d[k]+m, len[k]-m);
 		}
-	if(mvl_vector_length(vec[i])!=N)return -4;
 	}
-	
-for(i=0;i<indices_count;i++) {
-	if(indices[i]>=N)return -5;
+
+for(;i<count;i++) {
+	row=(indices==NULL) ? i+i0 : indices[i];
+	hash[i]=mvl_accumulate_hash64(hash[i], mvl_packed_list_get_entry(vec, data, row), mvl_packed_list_get_entry_bytelength(vec, row));
 	}
+return 0;
+}
 
-for(j=0;j<vec_count;j++) {
-	switch(mvl_vector_type(vec[j])) {
+/* Hash a block of rows over all columns. Rows are given by indices, or are i0 to i0+count-1 if indices is NULL. */
+static int mvl_hash_block(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, int flags)
+{
+LIBMVL_OFFSET64 i, j;
+int err;
+
+if(flags & LIBMVL_INIT_HASH) {
+	for(i=0;i<count;i++) {
+		hash[i]=MVL_SEED_HASH_VALUE;
+		}
+	}
+
+for(j=0;j<vec_count;j++) {
+	switch(mvl_vector_type(vec[j])) {
 		case LIBMVL_VECTOR_CSTRING:
 		case LIBMVL_VECTOR_UINT8: 
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_hash64(hash[i], (const unsigned char *)&(mvl_vector_data_uint8(vec[j])[indices[i]]), 1);
-				}
+			mvl_hash_uint8_kernel(count, indices, hash, mvl_vector_data_uint8(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_VECTOR_INT32:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_int32_hash64(hash[i], &(mvl_vector_data_int32(vec[j])[indices[i]]), 1);
-				}
+			mvl_hash_int32_kernel(count, indices, hash, mvl_vector_data_int32(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_VECTOR_INT64:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_int64_hash64(hash[i], &(mvl_vector_data_int64(vec[j])[indices[i]]), 1);
-				}
+			mvl_hash_int64_kernel(count, indices, hash, mvl_vector_data_int64(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_VECTOR_FLOAT:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_float_hash64(hash[i], &(mvl_vector_data_float(vec[j])[indices[i]]), 1);
-				}
+			mvl_hash_float_kernel(count, indices, hash, mvl_vector_data_float(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_VECTOR_DOUBLE:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_double_hash64(hash[i], &(mvl_vector_data_double(vec[j])[indices[i]]), 1);
-				}
+			mvl_hash_double_kernel(count, indices, hash, mvl_vector_data_double(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_VECTOR_OFFSET64: /* TODO: we might want to do something more clever here */
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_hash64(hash[i], (const unsigned char *)&(mvl_vector_data_int64(vec[j])[indices[i]]), 8);
-				}
+			mvl_hash_offset64_kernel(count, indices, hash, mvl_vector_data_offset(vec[j])+(indices==NULL ? i0 : 0));
 			break;
 		case LIBMVL_PACKED_LIST64: {
 			if(vec_data==NULL)return -6;
 			if(vec_data[j]==NULL)return -7;
-			for(i=0;i<indices_count;i++) {
-				if(mvl_packed_list_validate_entry(vec[j], vec_data[j], vec_data_length[j], indices[i]))return -8;
-				
-				hash[i]=mvl_accumulate_hash64(hash[i], mvl_packed_list_get_entry(vec[j], vec_data[j], indices[i]), mvl_packed_list_get_entry_bytelength(vec[j], indices[i]));
-				}
+			err=mvl_hash_packed_list64_kernel(count, indices, i0, hash, vec[j], vec_data[j], vec_data_length[j]);
+			if(err<0)return(err);
 			break;
 			}
 		default:
@@ -2388,14 +3785,82 @@ for(j=0;j<vec_count;j++) {
 	}
 	
 if(flags & LIBMVL_FINALIZE_HASH) {
-	for(i=0;i<indices_count;i++) {
+	for(i=0;i<count;i++) {
 		hash[i]=mvl_randomize_bits64(hash[i]);
 		}
 	}
-	
 return 0;
 }
 
+/* Rows are given by indices, or are i0 to i0+count-1 if indices is NULL */
+static int mvl_hash_blocks(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, int flags)
+{
+LIBMVL_OFFSET64 b, n;
+int err, e;
+
+err=0;
+MVL_OMP(omp parallel for private(n, e) schedule(static) if(count>=LIBMVL_PARALLEL_HASH_THRESHOLD))
+for(b=0;b<count;b+=LIBMVL_HASH_BLOCK) {
+	n=count-b;
+	if(n>LIBMVL_HASH_BLOCK)n=LIBMVL_HASH_BLOCK;
+	e=mvl_hash_block(n, indices==NULL ? NULL : indices+b, i0+b, hash+b, vec_count, vec, vec_data, vec_data_length, flags);
+	if(e<0) {
+		MVL_OMP(omp critical)
+		err=e;
+		}
+	}
+return(err);
+}
+
+/*! @brief This function is used to compute 64 bit hash of vector values
+ * array hash[] is passed in and contains the result of the computation
+ * 
+ * Integer indices are computed by value, so that 100 produces the same hash whether it is stored as INT32 or INT64.
+ * 
+ * Floats and doubles are trickier - we can guarantee that the hash of a float promoted to a double is the same as the hash of the original float, but not the reverse.
+ * 
+ * @param indices_count  total number of indices 
+ * @param indices an array of indices into provided vectors
+ * @param hash a previously allocated array of length indices_count that the computed hashes will be written into
+ * @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
+ * @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
+ * @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL files
+ * @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from. 
+ * @param flags flags specifying whether to initialize or finalize hash
+ */
+int mvl_hash_indices(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, int flags)
+{
+LIBMVL_OFFSET64 i, N;
+
+if(vec_count<1) {
+	if(flags & LIBMVL_INIT_HASH) {
+		for(i=0;i<indices_count;i++) {
+			hash[i]=MVL_SEED_HASH_VALUE;
+			}
+		}
+	return 0;
+	}
+
+N=mvl_vector_length(vec[0]);
+//fprintf(stderr, "vec_count=%d N=%d\n", vec_count, N);
+if(mvl_vector_type(vec[0])==LIBMVL_PACKED_LIST64)N--;
+for(i=1;i<vec_count;i++) {
+	if(mvl_vector_type(vec[i])==LIBMVL_PACKED_LIST64) {
+		if(mvl_vector_length(vec[i])!=N+1)return -1;
+		if(vec_data==NULL)return -2;
+		if(vec_data[i]==NULL)return -3;
+		continue;
+		}
+	if(mvl_vector_length(vec[i])!=N)return -4;
+	}
+	
+for(i=0;i<indices_count;i++) {
+	if(indices[i]>=N)return -5;
+	}
+
+return(mvl_hash_blocks(indices_count, indices, 0, hash, vec_count, vec, vec_data, vec_data_length, flags));
+}
+
 /*! @brief This function is used to compute 64 bit hash of vector values
  * array hash[] is passed in and contains the result of the computation
  * 
@@ -2414,18 +3879,19 @@ return 0;
  */
 int mvl_hash_range(LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, int flags)
 {
-LIBMVL_OFFSET64 i, j, N, indices_count;
+LIBMVL_OFFSET64 i, N, indices_count;
 
 indices_count=i1-i0;
 
-if(flags & LIBMVL_INIT_HASH) {
-	for(i=0;i<indices_count;i++) {
-		hash[i]=MVL_SEED_HASH_VALUE;
+if(vec_count<1 || (i1<=i0)) {
+	if(flags & LIBMVL_INIT_HASH) {
+		for(i=0;i<indices_count;i++) {
+			hash[i]=MVL_SEED_HASH_VALUE;
+			}
 		}
+	return 0;
 	}
 
-if(vec_count<1 || (i1<=i0))return 0;
-
 N=mvl_vector_length(vec[0]);
 //fprintf(stderr, "vec_count=%d N=%d\n", vec_count, N);
 if(mvl_vector_type(vec[0])==LIBMVL_PACKED_LIST64)N--;
@@ -2441,61 +3907,7 @@ for(i=1;i<vec_count;i++) {
 
 if(i0>=N || i1>=N)return(-5);
 
-for(j=0;j<vec_count;j++) {
-	switch(mvl_vector_type(vec[j])) {
-		case LIBMVL_VECTOR_CSTRING:
-		case LIBMVL_VECTOR_UINT8: 
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_hash64(hash[i], (const unsigned char *)&(mvl_vector_data_uint8(vec[j])[i+i0]), 1);
-				}
-			break;
-		case LIBMVL_VECTOR_INT32:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_int32_hash64(hash[i], &(mvl_vector_data_int32(vec[j])[i+i0]), 1);
-				}
-			break;
-		case LIBMVL_VECTOR_INT64:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_int64_hash64(hash[i], &(mvl_vector_data_int64(vec[j])[i+i0]), 1);
-				}
-			break;
-		case LIBMVL_VECTOR_FLOAT:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_float_hash64(hash[i], &(mvl_vector_data_float(vec[j])[i+i0]), 1);
-				}
-			break;
-		case LIBMVL_VECTOR_DOUBLE:
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_double_hash64(hash[i], &(mvl_vector_data_double(vec[j])[i+i0]), 1);
-				}
-			break;
-		case LIBMVL_VECTOR_OFFSET64: /* TODO: we might want to do something more clever here */
-			for(i=0;i<indices_count;i++) {
-				hash[i]=mvl_accumulate_hash64(hash[i], (const unsigned char *)&(mvl_vector_data_int64(vec[j])[i+i0]), 8);
-				}
-			break;
-		case LIBMVL_PACKED_LIST64: {
-			if(vec_data==NULL)return -6;
-			if(vec_data[j]==NULL)return -7;
-			for(i=0;i<indices_count;i++) {
-				if(mvl_packed_list_validate_entry(vec[j], vec_data[j], vec_data_length[j], i+i0))return -8;
-				
-				hash[i]=mvl_accumulate_hash64(hash[i], mvl_packed_list_get_entry(vec[j], vec_data[j], i+i0), mvl_packed_list_get_entry_bytelength(vec[j], i+i0));
-				}
-			break;
-			}
-		default:
-			return(-1);
-		}
-	}
-	
-if(flags & LIBMVL_FINALIZE_HASH) {
-	for(i=0;i<indices_count;i++) {
-		hash[i]=mvl_randomize_bits64(hash[i]);
-		}
-	}
-	
-return 0;
+return(mvl_hash_blocks(indices_count, NULL, i0, hash, vec_count, vec, vec_data, vec_data_length, flags));
 }
 
 /*! @brief
@@ -2516,6 +3928,24 @@ while(hash_map_size<hash_count) {
 return(hash_map_size);
 }
 
+/*! @brief
+ *  Compute suggested number of slots of open addressing hash map given the number of entries to hash. The result is a power of 2, a multiple of LIBMVL_HASH_GROUP, and leaves at least 1/8 of the slots empty.
+ *  @param hash_count expected number of items to hash
+ *  @return suggested hash map size
+ */
+LIBMVL_OFFSET64 mvl_compute_open_hash_map_size(LIBMVL_OFFSET64 hash_count)
+{
+LIBMVL_OFFSET64 hash_map_size;
+
+if(hash_count & (15LLU<<60))return 0; /* Too big */
+
+hash_map_size=LIBMVL_HASH_GROUP;
+while(hash_map_size-(hash_map_size>>3)<hash_count) {
+	hash_map_size=hash_map_size<<1;
+	}
+return(hash_map_size);
+}
+
 /*! @brief Create HASH_MAP structure. 
  * 
  *  This creates default HASH_MAP structure with all members allocated with new arrays. In some situations, such as to save memory it is possible to reuse existing arrays by specifying hm->flags appropriately. In such case, one should not use this constructor and instead create the structure manually.
@@ -2524,22 +3954,48 @@ return(hash_map_size);
  */
 HASH_MAP *mvl_allocate_hash_map(LIBMVL_OFFSET64 max_index_count)
 {
+return(mvl_allocate_hash_map_flags(max_index_count, 0));
+}
+
+/*! @brief Create HASH_MAP structure with a choice of layout. 
+ * 
+ *  Passing MVL_FLAG_OPEN_ADDRESSING in flags creates an open addressing hash map - each hash is located by comparing groups of one byte tags, and rows with equal hashes are
+ *  kept in a single chain. This avoids walking through colliding chains and is faster when the number of probes is large. Other flags are ignored. 
+ *  Each slot takes LIBMVL_HASH_SLOT_SIZE*8+1 bytes, compared to 8 bytes per hash_map entry of the chained layout, so the open addressing layout trades memory for probe speed.
+ *  mvl_compute_hash_map(), mvl_hash_match_count(), mvl_find_first_hashes(), mvl_find_matches() and mvl_find_groups() work with either layout.
+ *  @param max_index_count expected number of entries to hash
+ *  @param flags either 0 or MVL_FLAG_OPEN_ADDRESSING
+ *  @return pointer to allocated HASH_MAP structure
+ */
+HASH_MAP *mvl_allocate_hash_map_flags(LIBMVL_OFFSET64 max_index_count, LIBMVL_OFFSET64 flags)
+{
 HASH_MAP *hm;
 
 hm=do_malloc(1, sizeof(*hm));
 hm->hash_count=0;
 hm->hash_size=max_index_count;
-hm->hash_map_size=mvl_compute_hash_map_size(max_index_count);
+hm->first_count=0;
 
 hm->hash=do_malloc(hm->hash_size, sizeof(hm->hash));
-hm->hash_map=do_malloc(hm->hash_map_size, sizeof(*hm->hash_map));
 hm->first=do_malloc(hm->hash_size, sizeof(*hm->first));
 hm->next=do_malloc(hm->hash_size, sizeof(*hm->next));
 
 hm->vec_count=0;
+hm->vec_types=NULL;
 
 hm->flags=MVL_FLAG_OWN_HASH | MVL_FLAG_OWN_HASH_MAP | MVL_FLAG_OWN_FIRST | MVL_FLAG_OWN_NEXT;
 
+if(flags & MVL_FLAG_OPEN_ADDRESSING) {
+	hm->hash_map_size=mvl_compute_open_hash_map_size(max_index_count);
+	hm->hash_map=do_malloc(hm->hash_map_size, LIBMVL_HASH_SLOT_SIZE*sizeof(*hm->hash_map));
+	hm->tags=do_malloc(hm->hash_map_size, sizeof(*hm->tags));
+	hm->flags|=MVL_FLAG_OWN_TAGS | MVL_FLAG_OPEN_ADDRESSING;
+	} else {
+	hm->hash_map_size=mvl_compute_hash_map_size(max_index_count);
+	hm->hash_map=do_malloc(hm->hash_map_size, sizeof(*hm->hash_map));
+	hm->tags=NULL;
+	}
+
 return(hm);
 }
 
@@ -2553,6 +4009,7 @@ if(hash_map->flags & MVL_FLAG_OWN_HASH_MAP)free(hash_map->hash_map);
 if(hash_map->flags & MVL_FLAG_OWN_FIRST)free(hash_map->first);
 if(hash_map->flags & MVL_FLAG_OWN_NEXT)free(hash_map->next);
 if(hash_map->flags & MVL_FLAG_OWN_VEC_TYPES)free(hash_map->vec_types);
+if(hash_map->flags & MVL_FLAG_OWN_TAGS)free(hash_map->tags);
 
 hash_map->hash_size=0;
 hash_map->hash_map_size=0;
@@ -2560,6 +4017,104 @@ hash_map->vec_count=0;
 free(hash_map);
 }
 
+/* Open addressing layout: slots are arranged in groups of LIBMVL_HASH_GROUP and each slot has a one byte tag - 0 for an empty slot and 0x80 | (top 7 bits of hash) otherwise.
+ * hm->hash_map holds LIBMVL_HASH_SLOT_SIZE words per slot: hash value and the last row with this hash. 
+ * Rows with identical hashes are chained through hm->next in the same order as in the chained layout, so the number of rows with a given hash is the length of its chain.
+ */
+static inline unsigned char mvl_hash_tag(LIBMVL_OFFSET64 hash)
+{
+return(0x80 | (hash>>57));
+}
+
+/* Bitmask of slots in a group with matching tag */
+static inline unsigned int mvl_match_tag_group(const unsigned char *tags, unsigned char tag)
+{
+#ifdef __SSE2__
+return(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)tags), _mm_set1_epi8((char)tag))));
+#else
+unsigned int mask=0;
+int j;
+for(j=0;j<LIBMVL_HASH_GROUP;j++)
+	mask|=(tags[j]==tag)<<j;
+return(mask);
+#endif
+}
+
+static inline int mvl_lowest_bit(unsigned int mask)
+{
+#ifdef __GNUC__
+return(__builtin_ctz(mask));
+#else
+int j=0;
+while(!(mask & 1)) {
+	mask=mask>>1;
+	j++;
+	}
+return(j);
+#endif
+}
+
+/* Return the slot holding hash, or the empty slot where it should be inserted */
+static inline LIBMVL_OFFSET64 mvl_open_hash_map_slot(const HASH_MAP *hm, LIBMVL_OFFSET64 hash)
+{
+LIBMVL_OFFSET64 group, group_mask, slot;
+const unsigned char *tags;
+unsigned int mask;
+unsigned char tag;
+
+group_mask=hm->hash_map_size/LIBMVL_HASH_GROUP-1;
+group=hash & group_mask;
+tag=mvl_hash_tag(hash);
+
+while(1) {
+	tags=&(hm->tags[group*LIBMVL_HASH_GROUP]);
+	mask=mvl_match_tag_group(tags, tag);
+	while(mask) {
+		slot=group*LIBMVL_HASH_GROUP+mvl_lowest_bit(mask);
+		if(hm->hash_map[slot*LIBMVL_HASH_SLOT_SIZE]==hash)return(slot);
+		mask&=mask-1;
+		}
+	mask=mvl_match_tag_group(tags, 0);
+	if(mask)return(group*LIBMVL_HASH_GROUP+mvl_lowest_bit(mask));
+	group=(group+1) & group_mask;
+	}
+}
+
+static void mvl_compute_open_hash_map(HASH_MAP *hm)
+{
+LIBMVL_OFFSET64 i, k, slot, N_first, hash_count;
+LIBMVL_OFFSET64 *hash_map, *next, *first, *hash;
+
+hash_count=hm->hash_count;
+hash=hm->hash;
+hash_map=hm->hash_map;
+first=hm->first;
+next=hm->next;
+
+memset(hm->tags, 0, hm->hash_map_size*sizeof(*hm->tags));
+
+N_first=0;
+for(i=0;i<hash_count;i++) {
+	slot=mvl_open_hash_map_slot(hm, hash[i]);
+	k=slot*LIBMVL_HASH_SLOT_SIZE;
+	if(!hm->tags[slot]) {
+		hm->tags[slot]=mvl_hash_tag(hash[i]);
+		hash_map[k]=hash[i];
+		hash_map[k+1]=i;
+		first[N_first]=slot;
+		next[i]=~0LLU;
+		N_first++;
+		continue;
+		}
+	next[i]=hash_map[k+1];
+	hash_map[k+1]=i;
+	}
+for(i=0;i<N_first;i++) {
+	first[i]=hash_map[first[i]*LIBMVL_HASH_SLOT_SIZE+1];
+	}
+hm->first_count=N_first;
+}
+
 /*! @brief Compute hash map. This assumes that hm->hash array has been populated with hm->hash_count hashes computed with mvl_hash_indices().
  *  @param hm a pointer to HASH_MAP structure
  */
@@ -2569,6 +4124,11 @@ LIBMVL_OFFSET64 i, k, hash_mask, N_first, hash_count;
 LIBMVL_OFFSET64 hash_map_size;
 LIBMVL_OFFSET64 *hash_map, *next, *first, *hash;
  
+if(hm->flags & MVL_FLAG_OPEN_ADDRESSING) {
+	mvl_compute_open_hash_map(hm);
+	return;
+	}
+ 
 hash_count=hm->hash_count;
 hash=hm->hash;
 hash_map=hm->hash_map;
@@ -2622,6 +4182,62 @@ if(hash_mask & hash_map_size) {
 hm->first_count=N_first;
 }
 
+/* Probes are processed in windows of LIBMVL_HASH_PROBE_WINDOW keys. All table loads for the window are issued before any of them is used, 
+ * so that cache misses overlap instead of stalling one key at a time. */
+#ifndef LIBMVL_HASH_PROBE_WINDOW
+#define LIBMVL_HASH_PROBE_WINDOW	16
+#endif
+
+#ifdef __GNUC__
+#define MVL_PREFETCH(p)	__builtin_prefetch(p)
+#else
+#define MVL_PREFETCH(p)
+#endif
+
+/* Find chain heads of chained HASH_MAP for count<=LIBMVL_HASH_PROBE_WINDOW keys, prefetching buckets and then the first chain entries */
+static inline void mvl_hash_map_heads(const HASH_MAP *hm, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *key_hash, LIBMVL_OFFSET64 *heads)
+{
+LIBMVL_OFFSET64 i, k, hash_map_size, hash_mask;
+
+hash_map_size=hm->hash_map_size;
+hash_mask=hash_map_size-1;
+
+if(hash_map_size & hash_mask) {
+	for(i=0;i<count;i++) {
+		heads[i]=key_hash[i] % hash_map_size;
+		MVL_PREFETCH(&(hm->hash_map[heads[i]]));
+		}
+	} else {
+	for(i=0;i<count;i++) {
+		heads[i]=key_hash[i] & hash_mask;
+		MVL_PREFETCH(&(hm->hash_map[heads[i]]));
+		}
+	}
+for(i=0;i<count;i++) {
+	k=hm->hash_map[heads[i]];
+	heads[i]=k;
+	if(k!=~0LLU) {
+		MVL_PREFETCH(&(hm->hash[k]));
+		MVL_PREFETCH(&(hm->next[k]));
+		}
+	}
+}
+
+/* Same for open addressing HASH_MAP - tag groups are prefetched and slots are returned */
+static inline void mvl_open_hash_map_slots(const HASH_MAP *hm, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *key_hash, LIBMVL_OFFSET64 *slots)
+{
+LIBMVL_OFFSET64 i, group_mask;
+
+group_mask=hm->hash_map_size/LIBMVL_HASH_GROUP-1;
+
+for(i=0;i<count;i++) {
+	MVL_PREFETCH(&(hm->tags[(key_hash[i] & group_mask)*LIBMVL_HASH_GROUP]));
+	}
+for(i=0;i<count;i++) {
+	slots[i]=mvl_open_hash_map_slot(hm, key_hash[i]);
+	}
+}
+
 /*! @brief Find count of matches between hashes of two sets. 
  * 
  * This function is useful to find the upper limit on the number of possible matches, so one can allocate arrays for the result or plan computation in some other way.
@@ -2632,32 +4248,33 @@ hm->first_count=N_first;
  */
 LIBMVL_OFFSET64 mvl_hash_match_count(LIBMVL_OFFSET64 key_count, const LIBMVL_OFFSET64 *key_hash, HASH_MAP *hm)
 {
-LIBMVL_OFFSET64 i, k, hash_mask, match_count;
+LIBMVL_OFFSET64 i, j, k, n, match_count;
 LIBMVL_OFFSET64 *hash_map, *next, *hash;
-LIBMVL_OFFSET64 hash_map_size;
+LIBMVL_OFFSET64 heads[LIBMVL_HASH_PROBE_WINDOW];
 
-
-hash_map_size=hm->hash_map_size;
 hash=hm->hash;
 hash_map=hm->hash_map;
 next=hm->next;
 
-hash_mask=hash_map_size-1;
-
 match_count=0;
-if(hash_map_size & hash_mask) {
-	for(i=0;i<key_count;i++) {
-		k=hash_map[key_hash[i] % hash_map_size];
-		while(k!=~0LLU) {
-			if(hash[k]==key_hash[i])match_count++;
-			k=next[k];
+for(i=0;i<key_count;i+=LIBMVL_HASH_PROBE_WINDOW) {
+	n=key_count-i;
+	if(n>LIBMVL_HASH_PROBE_WINDOW)n=LIBMVL_HASH_PROBE_WINDOW;
+
+	if(hm->flags & MVL_FLAG_OPEN_ADDRESSING) {
+		mvl_open_hash_map_slots(hm, n, &(key_hash[i]), heads);
+		for(j=0;j<n;j++) {
+			if(!hm->tags[heads[j]])continue;
+			for(k=hash_map[heads[j]*LIBMVL_HASH_SLOT_SIZE+1];k!=~0LLU;k=next[k])match_count++;
 			}
+		continue;
 		}
-	} else {
-	for(i=0;i<key_count;i++) {
-		k=hash_map[key_hash[i] & hash_mask];
+
+	mvl_hash_map_heads(hm, n, &(key_hash[i]), heads);
+	for(j=0;j<n;j++) {
+		k=heads[j];
 		while(k!=~0LLU) {
-			if(hash[k]==key_hash[i])match_count++;
+			if(hash[k]==key_hash[i+j])match_count++;
 			k=next[k];
 			}
 		}
@@ -2672,33 +4289,34 @@ return(match_count);
  */
 void mvl_find_first_hashes(LIBMVL_OFFSET64 key_count, const LIBMVL_OFFSET64 *key_hash, LIBMVL_OFFSET64 *key_indices, HASH_MAP *hm)
 {
-LIBMVL_OFFSET64 i, k, hash_mask, hash_map_size;
+LIBMVL_OFFSET64 i, j, k, n;
 LIBMVL_OFFSET64 *hash_map, *next, *hash;
+LIBMVL_OFFSET64 heads[LIBMVL_HASH_PROBE_WINDOW];
 
 hash=hm->hash;
-hash_map_size=hm->hash_map_size;
 hash_map=hm->hash_map;
 next=hm->next;
 
-hash_mask=hash_map_size-1;
+for(i=0;i<key_count;i+=LIBMVL_HASH_PROBE_WINDOW) {
+	n=key_count-i;
+	if(n>LIBMVL_HASH_PROBE_WINDOW)n=LIBMVL_HASH_PROBE_WINDOW;
 
-if(hash_map_size & hash_mask) {
-	for(i=0;i<key_count;i++) {
-		k=hash_map[key_hash[i] % hash_map_size];
-		while(k!=~0LLU) {
-			if(hash[k]==key_hash[i])break;
-			k=next[k];
+	if(hm->flags & MVL_FLAG_OPEN_ADDRESSING) {
+		mvl_open_hash_map_slots(hm, n, &(key_hash[i]), heads);
+		for(j=0;j<n;j++) {
+			key_indices[i+j]=hm->tags[heads[j]] ? hash_map[heads[j]*LIBMVL_HASH_SLOT_SIZE+1] : ~0LLU;
 			}
-		key_indices[i]=k;
+		continue;
 		}
-	} else {
-	for(i=0;i<key_count;i++) {
-		k=hash_map[key_hash[i] & hash_mask];
+
+	mvl_hash_map_heads(hm, n, &(key_hash[i]), heads);
+	for(j=0;j<n;j++) {
+		k=heads[j];
 		while(k!=~0LLU) {
-			if(hash[k]==key_hash[i])break;
+			if(hash[k]==key_hash[i+j])break;
 			k=next[k];
 			}
-		key_indices[i]=k;
+		key_indices[i+j]=k;
 		}
 	}
 }
@@ -2741,7 +4359,8 @@ int mvl_find_matches(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *k
 			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 pairs_size, LIBMVL_OFFSET64 *key_match_indices, LIBMVL_OFFSET64 *match_indices)
 {
 LIBMVL_OFFSET64 *hash, *hash_map, *next;
-LIBMVL_OFFSET64 hash_map_size, i, k, hash_mask, N_matches;
+LIBMVL_OFFSET64 i, j, k, n, N_matches;
+LIBMVL_OFFSET64 heads[LIBMVL_HASH_PROBE_WINDOW];
 MVL_SORT_INFO key_si, si;
 MVL_SORT_UNIT key_su, su;
 
@@ -2758,128 +4377,1333 @@ si.nvec=vec_count;
 key_su.info=&key_si;
 su.info=&si;
 
-hash_map_size=hm->hash_map_size;
-hash_mask=hash_map_size-1;
 hash_map=hm->hash_map;
 hash=hm->hash;
 next=hm->next;
 
 N_matches=0;
 
-if(hash_map_size & hash_mask) {
-	for(i=0;i<key_indices_count;i++) {
-		k=hash_map[key_hash[i] % hash_map_size];
-		key_su.index=key_indices[i];
-		while(k!=~0LLU) {
-			su.index=indices[k];
-			if((hash[k]==key_hash[i])  && mvl_equals(&key_su, &su) ) {
-				if(N_matches>=pairs_size)return(-1000);
-				key_match_indices[N_matches]=key_indices[i];
-				match_indices[N_matches]=indices[k];
-				N_matches++;
+for(i=0;i<key_indices_count;i+=LIBMVL_HASH_PROBE_WINDOW) {
+	n=key_indices_count-i;
+	if(n>LIBMVL_HASH_PROBE_WINDOW)n=LIBMVL_HASH_PROBE_WINDOW;
+
+	if(hm->flags & MVL_FLAG_OPEN_ADDRESSING) {
+		mvl_open_hash_map_slots(hm, n, &(key_hash[i]), heads);
+		for(j=0;j<n;j++) {
+			if(hm->tags[heads[j]]) {
+				k=hash_map[heads[j]*LIBMVL_HASH_SLOT_SIZE+1];
+				MVL_PREFETCH(&(indices[k]));
 				}
-			k=next[k];
 			}
-		key_last[i]=N_matches;
+		for(j=0;j<n;j++) {
+			key_su.index=key_indices[i+j];
+			if(hm->tags[heads[j]]) {
+				/* All rows in the chain have the same hash */
+				for(k=hash_map[heads[j]*LIBMVL_HASH_SLOT_SIZE+1];k!=~0LLU;k=next[k]) {
+					su.index=indices[k];
+					if(mvl_equals(&key_su, &su)) {
+						if(N_matches>=pairs_size)return(-1000);
+						key_match_indices[N_matches]=key_indices[i+j];
+						match_indices[N_matches]=indices[k];
+						N_matches++;
+						}
+					}
+				}
+			key_last[i+j]=N_matches;
+			}
+		continue;
 		}
-	} else {
-	for(i=0;i<key_indices_count;i++) {
-		k=hash_map[key_hash[i] & hash_mask];
-		key_su.index=key_indices[i];
+
+	mvl_hash_map_heads(hm, n, &(key_hash[i]), heads);
+	for(j=0;j<n;j++) {
+		if(heads[j]!=~0LLU)MVL_PREFETCH(&(indices[heads[j]]));
+		}
+	for(j=0;j<n;j++) {
+		k=heads[j];
+		key_su.index=key_indices[i+j];
 		while(k!=~0LLU) {
 			su.index=indices[k];
-			if((hash[k]==key_hash[i])  && mvl_equals(&key_su, &su) ) {
+			if((hash[k]==key_hash[i+j])  && mvl_equals(&key_su, &su) ) {
 				if(N_matches>=pairs_size)return(-1000);
-				key_match_indices[N_matches]=key_indices[i];
+				key_match_indices[N_matches]=key_indices[i+j];
 				match_indices[N_matches]=indices[k];
 				N_matches++;
 				}
 			k=next[k];
 			}
-		key_last[i]=N_matches;
+		key_last[i+j]=N_matches;
 		}
 	}
 return(0);
 }
 
-/*! @brief This function transforms HASH_MAP into a list of groups. Similar to GROUP BY clause in SQL.
- * 
- * The original HASH_MAP describes groups of rows with identical hashes. However, there is a (remote) possibility of collision where different rows have the same hash. This function resolves this ambiguity.
- * After calling hm->hash_map becomes invalid, but hm->first and hm->next describe exactly identical rows 
- * 
- *  @param indices_count number of elements in indices array
- *  @param indices an array of indices used to create HASH_MAP hm
- *  @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
- *  @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
- *  @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL 
- *  @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from.
- *  @param hm a previously computed (with mvl_compute_hash_map()) HASH_MAP
+/* mvl_hash_join() splits key rows into chunks of LIBMVL_JOIN_CHUNK rows, chunks are processed by several threads when there are at least LIBMVL_PARALLEL_JOIN_THRESHOLD key rows */
+#ifndef LIBMVL_JOIN_CHUNK
+#define LIBMVL_JOIN_CHUNK	(1LLU<<14)
+#endif
+
+#ifndef LIBMVL_PARALLEL_JOIN_THRESHOLD
+#define LIBMVL_PARALLEL_JOIN_THRESHOLD	(1LLU<<16)
+#endif
+
+/* mvl_hash_join() switches to mvl_partitioned_hash_join() when there are at least LIBMVL_PARTITIONED_JOIN_THRESHOLD "main" rows and at least 1/LIBMVL_PARTITIONED_JOIN_RATIO as many key rows.
+ * Partitions are chosen to have about LIBMVL_JOIN_PARTITION_ROWS "main" rows, so that their hash maps fit in cache, but there are no more than 2^LIBMVL_JOIN_MAX_PARTITION_BITS of them
  */
-void mvl_find_groups(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm)
+#ifndef LIBMVL_PARTITIONED_JOIN_THRESHOLD
+#define LIBMVL_PARTITIONED_JOIN_THRESHOLD	(1LLU<<22)
+#endif
+
+#ifndef LIBMVL_PARTITIONED_JOIN_RATIO
+#define LIBMVL_PARTITIONED_JOIN_RATIO	16
+#endif
+
+#ifndef LIBMVL_JOIN_PARTITION_ROWS
+#define LIBMVL_JOIN_PARTITION_ROWS	(1LLU<<15)
+#endif
+
+#ifndef LIBMVL_JOIN_MAX_PARTITION_BITS
+#define LIBMVL_JOIN_MAX_PARTITION_BITS	12
+#endif
+
+/* Stable scatter of rows by the top bits of their hash. Hashes and values are copied to part_hash[] and part_values[], and row positions to part_pos[] when it is not NULL.
+ * On return partition p occupies entries part_start[p] to part_start[p+1]-1
+ */
+static void mvl_radix_partition(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *hash, const LIBMVL_OFFSET64 *values, int bits, 
+				LIBMVL_OFFSET64 *part_hash, LIBMVL_OFFSET64 *part_values, LIBMVL_OFFSET64 *part_pos, LIBMVL_OFFSET64 *part_start)
 {
-LIBMVL_OFFSET64 *hash, *tmp, *next;
-LIBMVL_OFFSET64 i, j, l, m, k, group_count, first_count, a;
-MVL_SORT_INFO si;
+LIBMVL_OFFSET64 partition_count, chunk_count, chunk_size, c, p, i, i0, i1, k, total;
+LIBMVL_OFFSET64 *hist;
+int shift;
+
+shift=64-bits;
+partition_count=1LLU<<bits;
+chunk_count=mvl_max_threads();
+chunk_size=(count+chunk_count-1)/chunk_count;
+
+hist=do_malloc(chunk_count*partition_count, sizeof(*hist));
+memset(hist, 0, chunk_count*partition_count*sizeof(*hist));
+
+MVL_OMP(omp parallel for private(i, i0, i1) schedule(static) if(chunk_count>1))
+for(c=0;c<chunk_count;c++) {
+	i0=c*chunk_size;
+	i1=i0+chunk_size;
+	if(i1>count)i1=count;
+	for(i=i0;i<i1;i++)hist[c*partition_count+(hash[i]>>shift)]++;
+	}
+
+/* Offsets are assigned in (partition, chunk) order which keeps the scatter stable */
+total=0;
+for(p=0;p<partition_count;p++) {
+	part_start[p]=total;
+	for(c=0;c<chunk_count;c++) {
+		k=hist[c*partition_count+p];
+		hist[c*partition_count+p]=total;
+		total+=k;
+		}
+	}
+part_start[partition_count]=total;
+
+MVL_OMP(omp parallel for private(i, i0, i1, k) schedule(static) if(chunk_count>1))
+for(c=0;c<chunk_count;c++) {
+	i0=c*chunk_size;
+	i1=i0+chunk_size;
+	if(i1>count)i1=count;
+	for(i=i0;i<i1;i++) {
+		k=hist[c*partition_count+(hash[i]>>shift)]++;
+		part_hash[k]=hash[i];
+		part_values[k]=values[i];
+		if(part_pos!=NULL)part_pos[k]=i;
+		}
+	}
+
+free(hist);
+}
+
+/*! @brief Compute pairs of merge indices by partitioning both sets of rows on hash bits. This is similar to JOIN operation in SQL.
+ * 
+ * This function has the same arguments and output as mvl_hash_join(), and is more efficient when the hash map of "main" table set is much larger than the CPU cache.
+ * The hashes of both sets are radix partitioned on their top bits into partitions with about LIBMVL_JOIN_PARTITION_ROWS "main" rows each. 
+ * A small HASH_MAP is built and probed for each partition, with partitions processed in parallel when libMVL is compiled with OpenMP support.
+ * Only hm->hash and hm->hash_count are used, so there is no need to call mvl_compute_hash_map() beforehand.
+ * 
+ *  @param key_indices_count  number of entries in key_indices array
+ *  @param key_indices an array with indices into "key" table-like vector set
+ *  @param key_vec_count number of vectors in "key" table set
+ *  @param key_vec an array of vectors in "key" table set
+ *  @param key_vec_data an array of pointers to memory mapped areas those "key" vectors derive from. This allows computing hash from vectors drawn from different MVL files
+ *  @param key_vec_data_length an array of lengths of memory mapped areas those "key" vectors derive from. 
+ *  @param key_hash an array of hashes of "key" vectors computed with mvl_hash_indices()
+ *  @param indices_count  number of entries in indices array
+ *  @param indices an array with indices into "main" table-like vector set
+ *  @param vec_count number of vectors in "main" table set
+ *  @param vec an array of vectors in "main" table set
+ *  @param vec_data an array of pointers to memory mapped areas those "main" vectors derive from. This allows computing hash from vectors drawn from different MVL files
+ *  @param vec_data_length an array of length of memory mapped areas those "main" vectors derive from.
+ *  @param hm a HASH_MAP of "main" table set with populated hash array
+ *  @param key_last this is an output array of size key_indices_count that describes stretches of matches with indentical "key" rows. Thus for "key" row i, the corresponding stretch is key_last[i-1] to key_last[i]-1
+ *  @param pairs_count the number of pairs found is stored here
+ *  @param key_match_indices a newly allocated array of "key" indices from each pair is stored here. It should be freed with free()
+ *  @param match_indices a newly allocated array of "main" indices from each pair is stored here. It should be freed with free()
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_partitioned_hash_join(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *key_indices, LIBMVL_OFFSET64 key_vec_count, LIBMVL_VECTOR **key_vec, void **key_vec_data, LIBMVL_OFFSET64 *key_vec_data_length, LIBMVL_OFFSET64 *key_hash,
+			   LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm, 
+			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 *pairs_count, LIBMVL_OFFSET64 **key_match_indices, LIBMVL_OFFSET64 **match_indices)
+{
+LIBMVL_OFFSET64 partition_count, p, l, i, n, nk, q, total;
+LIBMVL_OFFSET64 *main_hash, *main_indices, *main_start, *key_part_hash, *key_part_indices, *key_pos, *key_start, *count, *km, *mi;
+LIBMVL_OFFSET64 **part_km, **part_mi;
+LIBMVL_OFFSET64 *local_key_last, local_pairs;
+HASH_MAP *lhm;
+int bits, err, e;
+
+*pairs_count=0;
+*key_match_indices=NULL;
+*match_indices=NULL;
+
+bits=1;
+while((bits<LIBMVL_JOIN_MAX_PARTITION_BITS) && ((hm->hash_count>>bits)>LIBMVL_JOIN_PARTITION_ROWS))bits++;
+partition_count=1LLU<<bits;
+
+main_hash=do_malloc(hm->hash_count, sizeof(*main_hash));
+main_indices=do_malloc(hm->hash_count, sizeof(*main_indices));
+main_start=do_malloc(partition_count+1, sizeof(*main_start));
+key_part_hash=do_malloc(key_indices_count, sizeof(*key_part_hash));
+key_part_indices=do_malloc(key_indices_count, sizeof(*key_part_indices));
+key_pos=do_malloc(key_indices_count, sizeof(*key_pos));
+key_start=do_malloc(partition_count+1, sizeof(*key_start));
+
+mvl_radix_partition(hm->hash_count, hm->hash, indices, bits, main_hash, main_indices, NULL, main_start);
+mvl_radix_partition(key_indices_count, key_hash, key_indices, bits, key_part_hash, key_part_indices, key_pos, key_start);
+
+count=do_malloc(key_indices_count, sizeof(*count));
+part_km=do_malloc(partition_count, sizeof(*part_km));
+part_mi=do_malloc(partition_count, sizeof(*part_mi));
+
+/* Pass 1: join each partition into its own buffers and record the number of matches for each key row */
+err=0;
+MVL_OMP(omp parallel for private(l, n, nk, lhm, local_key_last, local_pairs, e) schedule(dynamic))
+for(p=0;p<partition_count;p++) {
+	part_km[p]=NULL;
+	part_mi[p]=NULL;
+	n=main_start[p+1]-main_start[p];
+	nk=key_start[p+1]-key_start[p];
+	if(n==0) {
+		for(l=key_start[p];l<key_start[p+1];l++)count[key_pos[l]]=0;
+		continue;
+		}
+	if(nk==0)continue;
+	
+	lhm=mvl_allocate_hash_map(n);
+	lhm->hash_count=n;
+	memcpy(lhm->hash, &(main_hash[main_start[p]]), n*sizeof(*lhm->hash));
+	mvl_compute_hash_map(lhm);
+	
+	local_key_last=do_malloc(nk, sizeof(*local_key_last));
+	local_pairs=mvl_hash_match_count(nk, &(key_part_hash[key_start[p]]), lhm);
+	part_km[p]=do_malloc(local_pairs, sizeof(**part_km));
+	part_mi[p]=do_malloc(local_pairs, sizeof(**part_mi));
+	
+	e=mvl_find_matches(nk, &(key_part_indices[key_start[p]]), key_vec_count, key_vec, key_vec_data, key_vec_data_length, &(key_part_hash[key_start[p]]),
+			   n, &(main_indices[main_start[p]]), vec_count, vec, vec_data, vec_data_length, lhm, 
+			   local_key_last, local_pairs, part_km[p], part_mi[p]);
+	if(e<0) {
+		MVL_OMP(omp critical)
+		err=e;
+		}
+	
+	for(l=0;l<nk;l++) {
+		count[key_pos[key_start[p]+l]]=local_key_last[l]-(l>0 ? local_key_last[l-1] : 0);
+		}
+	
+	free(local_key_last);
+	mvl_free_hash_map(lhm);
+	}
+
+free(main_hash);
+free(main_indices);
+free(main_start);
+free(key_part_hash);
+free(key_part_indices);
+
+if(err<0) {
+	for(p=0;p<partition_count;p++) {
+		free(part_km[p]);
+		free(part_mi[p]);
+		}
+	free(part_km);
+	free(part_mi);
+	free(key_pos);
+	free(key_start);
+	free(count);
+	return(err);
+	}
+
+total=0;
+for(i=0;i<key_indices_count;i++) {
+	total+=count[i];
+	key_last[i]=total;
+	}
+
+km=do_malloc(total, sizeof(*km));
+mi=do_malloc(total, sizeof(*mi));
+
+/* Pass 2: move matches of each key row into place, this keeps the order of mvl_find_matches() */
+MVL_OMP(omp parallel for private(l, i, q) schedule(dynamic))
+for(p=0;p<partition_count;p++) {
+	q=0;
+	for(l=key_start[p];l<key_start[p+1];l++) {
+		i=key_pos[l];
+		if(count[i]==0)continue;
+		memcpy(&(km[key_last[i]-count[i]]), &(part_km[p][q]), count[i]*sizeof(*km));
+		memcpy(&(mi[key_last[i]-count[i]]), &(part_mi[p][q]), count[i]*sizeof(*mi));
+		q+=count[i];
+		}
+	free(part_km[p]);
+	free(part_mi[p]);
+	}
+
+free(part_km);
+free(part_mi);
+free(key_pos);
+free(key_start);
+free(count);
+
+*pairs_count=total;
+*key_match_indices=km;
+*match_indices=mi;
+return(0);
+}
+
+/*! @brief Compute pairs of merge indices using several threads. This is similar to JOIN operation in SQL.
+ * 
+ * This function combines mvl_hash_match_count() and mvl_find_matches(), but allocates the output arrays itself and splits the work between threads when libMVL is compiled with OpenMP support.
+ * Key rows are split into chunks. The first pass counts hash matches of each chunk, which gives each chunk its own section of the output arrays. The second pass finds matches of all chunks in parallel writing directly into these sections.
+ * The output is identical to that of mvl_find_matches() with sufficiently large output arrays, including key_last.
+ * Large joins are passed to mvl_partitioned_hash_join(), see LIBMVL_PARTITIONED_JOIN_THRESHOLD.
+ * 
+ *  @param key_indices_count  number of entries in key_indices array
+ *  @param key_indices an array with indices into "key" table-like vector set
+ *  @param key_vec_count number of vectors in "key" table set
+ *  @param key_vec an array of vectors in "key" table set
+ *  @param key_vec_data an array of pointers to memory mapped areas those "key" vectors derive from. This allows computing hash from vectors drawn from different MVL files
+ *  @param key_vec_data_length an array of lengths of memory mapped areas those "key" vectors derive from. 
+ *  @param key_hash an array of hashes of "key" vectors computed with mvl_hash_indices()
+ *  @param indices_count  number of entries in indices array
+ *  @param indices an array with indices into "main" table-like vector set
+ *  @param vec_count number of vectors in "main" table set
+ *  @param vec an array of vectors in "main" table set
+ *  @param vec_data an array of pointers to memory mapped areas those "main" vectors derive from. This allows computing hash from vectors drawn from different MVL files
+ *  @param vec_data_length an array of length of memory mapped areas those "main" vectors derive from.
+ *  @param hm a previosly computed HASH_MAP of "main" table set
+ *  @param key_last this is an output array of size key_indices_count that describes stretches of matches with indentical "key" rows. Thus for "key" row i, the corresponding stretch is key_last[i-1] to key_last[i]-1
+ *  @param pairs_count the number of pairs found is stored here
+ *  @param key_match_indices a newly allocated array of "key" indices from each pair is stored here. It should be freed with free()
+ *  @param match_indices a newly allocated array of "main" indices from each pair is stored here. It should be freed with free()
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_hash_join(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *key_indices, LIBMVL_OFFSET64 key_vec_count, LIBMVL_VECTOR **key_vec, void **key_vec_data, LIBMVL_OFFSET64 *key_vec_data_length, LIBMVL_OFFSET64 *key_hash,
+			   LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm, 
+			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 *pairs_count, LIBMVL_OFFSET64 **key_match_indices, LIBMVL_OFFSET64 **match_indices)
+{
+LIBMVL_OFFSET64 chunk_count, c, i, i0, n, total;
+LIBMVL_OFFSET64 *offset, *start, *km, *mi;
+int err, e;
+
+if((hm->hash_count>=LIBMVL_PARTITIONED_JOIN_THRESHOLD) && (key_indices_count>=hm->hash_count/LIBMVL_PARTITIONED_JOIN_RATIO))
+	return(mvl_partitioned_hash_join(key_indices_count, key_indices, key_vec_count, key_vec, key_vec_data, key_vec_data_length, key_hash,
+			   indices_count, indices, vec_count, vec, vec_data, vec_data_length, hm, 
+			   key_last, pairs_count, key_match_indices, match_indices));
+
+*pairs_count=0;
+*key_match_indices=NULL;
+*match_indices=NULL;
+
+chunk_count=(key_indices_count+LIBMVL_JOIN_CHUNK-1)/LIBMVL_JOIN_CHUNK;
+offset=do_malloc(chunk_count+1, sizeof(*offset));
+start=do_malloc(chunk_count+1, sizeof(*start));
+
+/* Pass 1: hash matches are an upper bound on the number of pairs in each chunk */
+offset[0]=0;
+MVL_OMP(omp parallel for private(i0, n) schedule(dynamic) if(key_indices_count>=LIBMVL_PARALLEL_JOIN_THRESHOLD))
+for(c=0;c<chunk_count;c++) {
+	i0=c*LIBMVL_JOIN_CHUNK;
+	n=key_indices_count-i0;
+	if(n>LIBMVL_JOIN_CHUNK)n=LIBMVL_JOIN_CHUNK;
+	offset[c+1]=mvl_hash_match_count(n, &(key_hash[i0]), hm);
+	}
+
+for(c=0;c<chunk_count;c++)offset[c+1]+=offset[c];
+
+km=do_malloc(offset[chunk_count], sizeof(*km));
+mi=do_malloc(offset[chunk_count], sizeof(*mi));
+
+/* Pass 2: each chunk writes into its own section, key_last is relative to the start of the section */
+err=0;
+MVL_OMP(omp parallel for private(i0, n, e) schedule(dynamic) if(key_indices_count>=LIBMVL_PARALLEL_JOIN_THRESHOLD))
+for(c=0;c<chunk_count;c++) {
+	i0=c*LIBMVL_JOIN_CHUNK;
+	n=key_indices_count-i0;
+	if(n>LIBMVL_JOIN_CHUNK)n=LIBMVL_JOIN_CHUNK;
+	e=mvl_find_matches(n, &(key_indices[i0]), key_vec_count, key_vec, key_vec_data, key_vec_data_length, &(key_hash[i0]),
+			   indices_count, indices, vec_count, vec, vec_data, vec_data_length, hm, 
+			   &(key_last[i0]), offset[c+1]-offset[c], &(km[offset[c]]), &(mi[offset[c]]));
+	if(e<0) {
+		MVL_OMP(omp critical)
+		err=e;
+		}
+	}
+
+if(err<0) {
+	free(offset);
+	free(start);
+	free(km);
+	free(mi);
+	return(err);
+	}
+
+/* Rows with equal hashes that compare different leave gaps at the end of sections. These are rare, so the sections are compacted serially */
+total=0;
+for(c=0;c<chunk_count;c++) {
+	i0=c*LIBMVL_JOIN_CHUNK;
+	n=key_indices_count-i0;
+	if(n>LIBMVL_JOIN_CHUNK)n=LIBMVL_JOIN_CHUNK;
+	start[c]=total;
+	if(total<offset[c]) {
+		memmove(&(km[total]), &(km[offset[c]]), key_last[i0+n-1]*sizeof(*km));
+		memmove(&(mi[total]), &(mi[offset[c]]), key_last[i0+n-1]*sizeof(*mi));
+		}
+	total+=key_last[i0+n-1];
+	}
+
+MVL_OMP(omp parallel for private(i, i0, n) schedule(static) if(key_indices_count>=LIBMVL_PARALLEL_JOIN_THRESHOLD))
+for(c=0;c<chunk_count;c++) {
+	i0=c*LIBMVL_JOIN_CHUNK;
+	n=key_indices_count-i0;
+	if(n>LIBMVL_JOIN_CHUNK)n=LIBMVL_JOIN_CHUNK;
+	for(i=i0;i<i0+n;i++)key_last[i]+=start[c];
+	}
+
+free(offset);
+free(start);
+
+*pairs_count=total;
+*key_match_indices=km;
+*match_indices=mi;
+return(0);
+}
+
+/* mvl_find_groups() processes chains in parallel when there are at least LIBMVL_PARALLEL_GROUPS_THRESHOLD of them, in chunks of LIBMVL_GROUPS_CHUNK chains */
+#ifndef LIBMVL_PARALLEL_GROUPS_THRESHOLD
+#define LIBMVL_PARALLEL_GROUPS_THRESHOLD	(1LLU<<16)
+#endif
+
+#ifndef LIBMVL_GROUPS_CHUNK
+#define LIBMVL_GROUPS_CHUNK	(1LLU<<12)
+#endif
+
+/* Split chain of hm->first[i] with j rows copied into tmp[] into chains of identical rows. 
+ * The first of these chains is stored in hm->first[i], the others are stored in extra[], and their number is returned
+ */
+static LIBMVL_OFFSET64 mvl_split_group(LIBMVL_OFFSET64 i, LIBMVL_OFFSET64 j, LIBMVL_OFFSET64 *tmp, LIBMVL_OFFSET64 *extra, const LIBMVL_OFFSET64 *indices, MVL_SORT_INFO *si, HASH_MAP *hm)
+{
+LIBMVL_OFFSET64 l, m, a, extra_count;
+LIBMVL_OFFSET64 *hash, *next;
 MVL_SORT_UNIT su1, su2;
 
+su1.info=si;
+su2.info=si;
+
+hash=hm->hash;
+next=hm->next;
+
+extra_count=0;
+while(j>1) {
+	m=j-1;
+	l=1;
+	su1.index=indices[tmp[0]];
+	while(l<=m) {
+		su2.index=indices[tmp[l]];
+		if(hash[tmp[0]]!=hash[tmp[l]] || !mvl_equals(&su1, &su2)) {
+			if(l<m) {
+				a=tmp[m];
+				tmp[m]=tmp[l];
+				tmp[l]=a;
+				}
+			m--;
+			} else l++;
+		}
+	next[tmp[0]]=~0LLU;
+	for(m=1;m<l;m++)next[tmp[m]]=tmp[m-1];
+	if(l==j) {
+		hm->first[i]=tmp[l-1];
+		break;
+		} else {
+		extra[extra_count]=tmp[l-1];
+		extra_count++;
+		memmove(tmp, &(tmp[l]), (j-l)*sizeof(*tmp));
+		hm->first[i]=tmp[0];
+		hm->next[tmp[0]]=~0LLU;
+		j-=l;
+		}
+	}
+return(extra_count);
+}
+
+/*! @brief This function transforms HASH_MAP into a list of groups. Similar to GROUP BY clause in SQL.
+ * 
+ * The original HASH_MAP describes groups of rows with identical hashes. However, there is a (remote) possibility of collision where different rows have the same hash. This function resolves this ambiguity.
+ * After calling hm->hash_map becomes invalid, but hm->first and hm->next describe exactly identical rows 
+ * 
+ * When libMVL is compiled with OpenMP support and there are many groups, they are processed by several threads. The result does not depend on the number of threads.
+ * Also see mvl_find_groups_sorted() which describes groups with contiguous stretches of indices.
+ * 
+ *  @param indices_count number of elements in indices array
+ *  @param indices an array of indices used to create HASH_MAP hm
+ *  @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
+ *  @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
+ *  @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL 
+ *  @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from.
+ *  @param hm a previously computed (with mvl_compute_hash_map()) HASH_MAP
+ */
+void mvl_find_groups(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm)
+{
+LIBMVL_OFFSET64 *tmp, *next;
+LIBMVL_OFFSET64 i, i1, j, k, c, n, group_count, first_count, chunk_count, tmp_size, extra_size;
+LIBMVL_OFFSET64 **extra, *extra_count;
+MVL_SORT_INFO si;
+
 si.vec=vec;
 si.data=vec_data;
 si.data_length=vec_data_length;
 si.nvec=vec_count;
 
-su1.info=&si;
-su2.info=&si;
-
-tmp=hm->hash_map;
-hash=hm->hash;
 next=hm->next;
 
 group_count=hm->first_count;
 first_count=hm->first_count;
 
-for(i=0;i<first_count;i++) {
-	k=hm->first[i];
-	j=0;
-	while(k!=~0LLU) {
-		tmp[j]=k;
-		j++;
-		k=next[k];
-		}
-	while(j>1) {
-		m=j-1;
-		l=1;
-		su1.index=indices[tmp[0]];
-		while(l<=m) {
-			su2.index=indices[tmp[l]];
-			if(hash[tmp[0]]!=hash[tmp[l]] || !mvl_equals(&su1, &su2)) {
-				if(l<m) {
-					a=tmp[m];
-					tmp[m]=tmp[l];
-					tmp[l]=a;
-					}
-				m--;
-				} else l++;
+if(first_count<LIBMVL_PARALLEL_GROUPS_THRESHOLD || mvl_max_threads()<2) {
+	tmp=hm->hash_map;
+	for(i=0;i<first_count;i++) {
+		k=hm->first[i];
+		j=0;
+		while(k!=~0LLU) {
+			tmp[j]=k;
+			j++;
+			k=next[k];
+			}
+		group_count+=mvl_split_group(i, j, tmp, &(hm->first[group_count]), indices, &si, hm);
+		}
+	hm->first_count=group_count;
+	return;
+	}
+
+/* Each chunk collects heads of new groups separately, these are appended in chunk order so that the result is the same as above */
+chunk_count=(first_count+LIBMVL_GROUPS_CHUNK-1)/LIBMVL_GROUPS_CHUNK;
+extra=do_malloc(chunk_count, sizeof(*extra));
+extra_count=do_malloc(chunk_count, sizeof(*extra_count));
+
+MVL_OMP(omp parallel for private(i, i1, j, k, n, tmp, tmp_size, extra_size) schedule(dynamic))
+for(c=0;c<chunk_count;c++) {
+	tmp_size=64;
+	tmp=do_malloc(tmp_size, sizeof(*tmp));
+	extra_size=64;
+	extra[c]=do_malloc(extra_size, sizeof(**extra));
+	n=0;
+	
+	i1=(c+1)*LIBMVL_GROUPS_CHUNK;
+	if(i1>first_count)i1=first_count;
+	for(i=c*LIBMVL_GROUPS_CHUNK;i<i1;i++) {
+		k=hm->first[i];
+		j=0;
+		while(k!=~0LLU) {
+			if(j>=tmp_size)tmp=mvl_grow_offsets(tmp, j, &tmp_size, j+1);
+			tmp[j]=k;
+			j++;
+			k=next[k];
 			}
-		next[tmp[0]]=~0LLU;
-		for(m=1;m<l;m++)next[tmp[m]]=tmp[m-1];
-		if(l==j) {
-			hm->first[i]=tmp[l-1];
+		extra[c]=mvl_grow_offsets(extra[c], n, &extra_size, n+j);
+		n+=mvl_split_group(i, j, tmp, &(extra[c][n]), indices, &si, hm);
+		}
+	extra_count[c]=n;
+	free(tmp);
+	}
+
+for(c=0;c<chunk_count;c++) {
+	if(extra_count[c]>0)memcpy(&(hm->first[group_count]), extra[c], extra_count[c]*sizeof(*hm->first));
+	group_count+=extra_count[c];
+	free(extra[c]);
+	}
+free(extra);
+free(extra_count);
+
+hm->first_count=group_count;
+}
+
+/* mvl_find_groups_sorted() processes runs of equal hashes in parallel in chunks of this size */
+#ifndef LIBMVL_SORTED_GROUPS_CHUNK
+#define LIBMVL_SORTED_GROUPS_CHUNK	(1LLU<<14)
+#endif
+
+/* mvl_find_groups_sorted() splits rows by top bits of hash into partitions of about this many rows, which are sorted independently */
+#ifndef LIBMVL_SORTED_GROUPS_PARTITION_ROWS
+#define LIBMVL_SORTED_GROUPS_PARTITION_ROWS	(1LLU<<12)
+#endif
+
+/* Order pairs of (hash, position) */
+static int mvl_hash_position_cmp(const void *a, const void *b)
+{
+const LIBMVL_OFFSET64 *x=(const LIBMVL_OFFSET64 *)a;
+const LIBMVL_OFFSET64 *y=(const LIBMVL_OFFSET64 *)b;
+if(x[0]<y[0])return(-1);
+if(x[0]>y[0])return(1);
+if(x[1]<y[1])return(-1);
+if(x[1]>y[1])return(1);
+return(0);
+}
+
+/*! @brief Find groups of identical rows by sorting their hashes. Similar to GROUP BY clause in SQL.
+ * 
+ * This is an alternative to mvl_compute_hash_map() followed by mvl_find_groups(). Instead of chains, each group is described by a contiguous stretch of group_indices array, 
+ * which is convenient for aggregation. 
+ * Rows are sorted by hash and then by position, using several threads when libMVL is compiled with OpenMP support. Rare rows with identical hashes that compare different are split into separate groups.
+ * Thus group k consists of rows group_indices[groups->offset[k]] to group_indices[groups->offset[k+1]-1], listed in the order they occur in the indices array, and there are groups->count-1 groups.
+ * 
+ *  @param indices_count number of elements in indices array
+ *  @param indices an array of row indices
+ *  @param hash an array of hashes of rows computed with mvl_hash_indices()
+ *  @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
+ *  @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
+ *  @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL 
+ *  @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from.
+ *  @param group_indices an array of length indices_count that receives the indices arranged by group
+ *  @param groups a LIBMVL_PARTITION initialized with mvl_init_partition() that receives group boundaries
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_find_groups_sorted(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			   LIBMVL_OFFSET64 *group_indices, LIBMVL_PARTITION *groups)
+{
+LIBMVL_OFFSET64 *sorted_hash, *positions, *part_start, *pairs, *tmp;
+LIBMVL_OFFSET64 i, j, k, l, m, n, p, group_count;
+unsigned char *group_start;
+MVL_SORT_INFO si;
+MVL_SORT_UNIT su1, su2;
+int bits;
+
+si.vec=vec;
+si.data=vec_data;
+si.data_length=vec_data_length;
+si.nvec=vec_count;
+
+groups->count=0;
+if(groups->size<indices_count+1)mvl_extend_partition(groups, indices_count+1);
+groups->offset[0]=0;
+groups->count=1;
+if(indices_count<1)return(0);
+
+/* Sort positions by hash, ties are ordered by position. 
+ * Rows are first scattered by the top bits of hash, so that partitions can be sorted independently. */
+bits=1;
+while(bits<LIBMVL_JOIN_MAX_PARTITION_BITS && (indices_count>>bits)>LIBMVL_SORTED_GROUPS_PARTITION_ROWS)bits++;
+
+sorted_hash=do_malloc(indices_count, sizeof(*sorted_hash));
+positions=do_malloc(indices_count, sizeof(*positions));
+part_start=do_malloc((1LLU<<bits)+1, sizeof(*part_start));
+mvl_radix_partition(indices_count, hash, indices, bits, sorted_hash, group_indices, positions, part_start);
+
+pairs=do_malloc(indices_count, 2*sizeof(*pairs));
+
+MVL_OMP(omp parallel for private(k) schedule(dynamic, 1) if(indices_count>=LIBMVL_SORTED_GROUPS_CHUNK))
+for(p=0;p<(1LLU<<bits);p++) {
+	if(part_start[p+1]-part_start[p]<2)continue;
+	for(k=part_start[p];k<part_start[p+1];k++) {
+		pairs[2*k]=sorted_hash[k];
+		pairs[2*k+1]=positions[k];
+		}
+	qsort(&(pairs[2*part_start[p]]), part_start[p+1]-part_start[p], 2*sizeof(*pairs), mvl_hash_position_cmp);
+	for(k=part_start[p];k<part_start[p+1];k++) {
+		sorted_hash[k]=pairs[2*k];
+		group_indices[k]=indices[pairs[2*k+1]];
+		}
+	}
+
+free(pairs);
+free(positions);
+free(part_start);
+
+group_start=do_malloc(indices_count, sizeof(*group_start));
+memset(group_start, 0, indices_count*sizeof(*group_start));
+
+/* Each run of equal hashes is processed by the iteration at its start */
+MVL_OMP(omp parallel for private(j, k, l, m, n, tmp, su1, su2) schedule(dynamic, LIBMVL_SORTED_GROUPS_CHUNK) if(indices_count>=LIBMVL_SORTED_GROUPS_CHUNK))
+for(i=0;i<indices_count;i++) {
+	if(i>0 && sorted_hash[i]==sorted_hash[i-1])continue;
+	group_start[i]=1;
+	
+	n=1;
+	while(i+n<indices_count && sorted_hash[i+n]==sorted_hash[i])n++;
+	
+	su1.info=&si;
+	su2.info=&si;
+	su1.index=group_indices[i];
+	for(j=1;j<n;j++) {
+		su2.index=group_indices[i+j];
+		if(!mvl_equals(&su1, &su2))break;
+		}
+	if(j>=n)continue;
+	
+	/* Hash collision: stable partition the run into groups of identical rows */
+	tmp=do_malloc(n, sizeof(*tmp));
+	k=i;
+	while(k<i+n) {
+		group_start[k]=1;
+		su1.index=group_indices[k];
+		l=k+1;
+		m=0;
+		for(j=k+1;j<i+n;j++) {
+			su2.index=group_indices[j];
+			if(mvl_equals(&su1, &su2)) {
+				group_indices[l]=group_indices[j];
+				l++;
+				} else {
+				tmp[m]=group_indices[j];
+				m++;
+				}
+			}
+		if(m>0)memcpy(&(group_indices[l]), tmp, m*sizeof(*tmp));
+		k=l;
+		}
+	free(tmp);
+	}
+
+group_count=1;
+for(i=1;i<indices_count;i++) {
+	if(group_start[i]) {
+		groups->offset[group_count]=i;
+		group_count++;
+		}
+	}
+groups->offset[group_count]=indices_count;
+groups->count=group_count+1;
+
+free(sorted_hash);
+free(group_start);
+return(0);
+}
+
+/* Aggregation gathers values into blocks of LIBMVL_AGGREGATE_BLOCK doubles. Per-thread partial results are used when there are at least LIBMVL_PARALLEL_AGGREGATE_THRESHOLD rows 
+ * and they outnumber the partial results */
+#ifndef LIBMVL_AGGREGATE_BLOCK
+#define LIBMVL_AGGREGATE_BLOCK	1024
+#endif
+
+#ifndef LIBMVL_PARALLEL_AGGREGATE_THRESHOLD
+#define LIBMVL_PARALLEL_AGGREGATE_THRESHOLD	(1LLU<<16)
+#endif
+
+/*! @brief Compute group ids from a HASH_MAP transformed with mvl_find_groups()
+ * 
+ *  @param hm a HASH_MAP processed by mvl_find_groups()
+ *  @param group_id an array of length hm->hash_count. Each element is set to the group of corresponding row, from 0 to hm->first_count-1
+ */
+void mvl_hash_map_group_ids(HASH_MAP *hm, LIBMVL_OFFSET64 *group_id)
+{
+LIBMVL_OFFSET64 g, k;
+
+MVL_OMP(omp parallel for private(k) schedule(static) if(hm->first_count>=LIBMVL_PARALLEL_AGGREGATE_THRESHOLD))
+for(g=0;g<hm->first_count;g++) {
+	for(k=hm->first[g];k!=~0LLU;k=hm->next[k])group_id[k]=g;
+	}
+}
+
+/* Accumulated value of a single group. Integer values are aggregated exactly: minima and maxima as long long, sums as long double */
+typedef union {
+	double d;
+	long long i;
+	long double s;
+	} MVL_AGGREGATE_ACC;
+
+/* Returns 1 for integer vectors, 0 for floating point vectors, or a negative error code. LIBMVL_VECTOR_OFFSET64 holds offsets and indices, and is not aggregated */
+static int mvl_aggregate_integer(LIBMVL_VECTOR *vec, int aggregate)
+{
+if(aggregate==LIBMVL_AGGREGATE_COUNT)return(0);
+if(vec==NULL)return(LIBMVL_ERR_INVALID_PARAMETER);
+switch(mvl_vector_type(vec)) {
+	case LIBMVL_VECTOR_UINT8:
+	case LIBMVL_VECTOR_INT32:
+	case LIBMVL_VECTOR_INT64:
+		return(1);
+	case LIBMVL_VECTOR_FLOAT:
+	case LIBMVL_VECTOR_DOUBLE:
+		return(0);
+	default:
+		return(LIBMVL_ERR_UNKNOWN_TYPE);
+	}
+}
+
+/* Convert values vec[indices[i]] of an integer vector to long long */
+static void mvl_aggregate_gather_int(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, long long *values)
+{
+LIBMVL_OFFSET64 i;
+switch(mvl_vector_type(vec)) {
+	case LIBMVL_VECTOR_UINT8: {
+		unsigned char *data=mvl_vector_data_uint8(vec);
+		for(i=0;i<count;i++)values[i]=data[indices[i]];
+		break;
+		}
+	case LIBMVL_VECTOR_INT32: {
+		int *data=mvl_vector_data_int32(vec);
+		for(i=0;i<count;i++)values[i]=data[indices[i]];
+		break;
+		}
+	case LIBMVL_VECTOR_INT64: {
+		long long int *data=mvl_vector_data_int64(vec);
+		for(i=0;i<count;i++)values[i]=data[indices[i]];
+		break;
+		}
+	}
+}
+
+/* Convert values vec[indices[i]] of a floating point vector to double */
+static void mvl_aggregate_gather_double(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, double *values)
+{
+LIBMVL_OFFSET64 i;
+switch(mvl_vector_type(vec)) {
+	case LIBMVL_VECTOR_FLOAT: {
+		float *data=mvl_vector_data_float(vec);
+		for(i=0;i<count;i++)values[i]=data[indices[i]];
+		break;
+		}
+	case LIBMVL_VECTOR_DOUBLE: {
+		double *data=mvl_vector_data_double(vec);
+		for(i=0;i<count;i++)values[i]=data[indices[i]];
+		break;
+		}
+	}
+}
+
+static void mvl_aggregate_init(LIBMVL_OFFSET64 group_count, int aggregate, int integer, MVL_AGGREGATE_ACC *acc, LIBMVL_OFFSET64 *cnt)
+{
+LIBMVL_OFFSET64 g;
+MVL_AGGREGATE_ACC a;
+
+switch(aggregate) {
+	case LIBMVL_AGGREGATE_MIN:
+		if(integer)a.i=LLONG_MAX;
+			else a.d=INFINITY;
+		break;
+	case LIBMVL_AGGREGATE_MAX:
+		if(integer)a.i=LLONG_MIN;
+			else a.d= -INFINITY;
+		break;
+	default:
+		if(integer)a.s=0.0;
+			else a.d=0.0;
+	}
+for(g=0;g<group_count;g++) {
+	acc[g]=a;
+	cnt[g]=0;
+	}
+}
+
+/* Combine partial result b into a */
+static void mvl_aggregate_combine(int aggregate, int integer, MVL_AGGREGATE_ACC *a, const MVL_AGGREGATE_ACC *b)
+{
+switch(aggregate) {
+	case LIBMVL_AGGREGATE_COUNT:
+		break;
+	case LIBMVL_AGGREGATE_MIN:
+		if(integer) {
+			if(b->i<a->i)a->i=b->i;
+			} else {
+			if(b->d<a->d)a->d=b->d;
+			}
+		break;
+	case LIBMVL_AGGREGATE_MAX:
+		if(integer) {
+			if(b->i>a->i)a->i=b->i;
+			} else {
+			if(b->d>a->d)a->d=b->d;
+			}
+		break;
+	default:
+		if(integer)a->s+=b->s;
+			else a->d+=b->d;
+	}
+}
+
+/* Accumulate rows from i0 to i1-1 into acc[] and cnt[] */
+static int mvl_aggregate_range(LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 i1, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_VECTOR *vec, int aggregate, int integer, MVL_AGGREGATE_ACC *acc, LIBMVL_OFFSET64 *cnt)
+{
+double values[LIBMVL_AGGREGATE_BLOCK];
+long long ivalues[LIBMVL_AGGREGATE_BLOCK];
+const LIBMVL_OFFSET64 *gid;
+LIBMVL_OFFSET64 b, i, n;
+
+for(b=i0;b<i1;b+=LIBMVL_AGGREGATE_BLOCK) {
+	n=i1-b;
+	if(n>LIBMVL_AGGREGATE_BLOCK)n=LIBMVL_AGGREGATE_BLOCK;
+	gid=&(group_id[b]);
+	
+	for(i=0;i<n;i++)cnt[gid[i]]++;
+	if(aggregate==LIBMVL_AGGREGATE_COUNT)continue;
+	
+	if(integer) {
+		mvl_aggregate_gather_int(n, &(indices[b]), vec, ivalues);
+		switch(aggregate) {
+			case LIBMVL_AGGREGATE_SUM:
+			case LIBMVL_AGGREGATE_MEAN:
+				for(i=0;i<n;i++)acc[gid[i]].s+=ivalues[i];
+				break;
+			case LIBMVL_AGGREGATE_MIN:
+				for(i=0;i<n;i++)
+					if(ivalues[i]<acc[gid[i]].i)acc[gid[i]].i=ivalues[i];
+				break;
+			case LIBMVL_AGGREGATE_MAX:
+				for(i=0;i<n;i++)
+					if(ivalues[i]>acc[gid[i]].i)acc[gid[i]].i=ivalues[i];
+				break;
+			default:
+				return(LIBMVL_ERR_INVALID_PARAMETER);
+			}
+		continue;
+		}
+	
+	mvl_aggregate_gather_double(n, &(indices[b]), vec, values);
+	switch(aggregate) {
+		case LIBMVL_AGGREGATE_SUM:
+		case LIBMVL_AGGREGATE_MEAN:
+			for(i=0;i<n;i++)acc[gid[i]].d+=values[i];
+			break;
+		case LIBMVL_AGGREGATE_MIN:
+			for(i=0;i<n;i++)
+				if(values[i]<acc[gid[i]].d)acc[gid[i]].d=values[i];
+			break;
+		case LIBMVL_AGGREGATE_MAX:
+			for(i=0;i<n;i++)
+				if(values[i]>acc[gid[i]].d)acc[gid[i]].d=values[i];
+			break;
+		default:
+			return(LIBMVL_ERR_INVALID_PARAMETER);
+		}
+	}
+return(0);
+}
+
+/* Convert accumulated values to double */
+static void mvl_aggregate_finish(LIBMVL_OFFSET64 group_count, int aggregate, int integer, const MVL_AGGREGATE_ACC *acc, const LIBMVL_OFFSET64 *cnt, double *result)
+{
+LIBMVL_OFFSET64 g;
+
+for(g=0;g<group_count;g++) {
+	switch(aggregate) {
+		case LIBMVL_AGGREGATE_COUNT:
+			result[g]=cnt[g];
+			break;
+		case LIBMVL_AGGREGATE_MEAN:
+			if(cnt[g]<1)result[g]=NAN;
+				else result[g]=integer ? (double)(acc[g].s/cnt[g]) : acc[g].d/cnt[g];
+			break;
+		case LIBMVL_AGGREGATE_MIN:
+			result[g]=(integer && cnt[g]>0) ? (double)acc[g].i : (integer ? INFINITY : acc[g].d);
+			break;
+		case LIBMVL_AGGREGATE_MAX:
+			result[g]=(integer && cnt[g]>0) ? (double)acc[g].i : (integer ? -INFINITY : acc[g].d);
 			break;
+		default:
+			result[g]=integer ? (double)acc[g].s : acc[g].d;
+		}
+	}
+}
+
+/* Compute combined accumulators acc[] and row counts cnt[] of all groups. The arrays are allocated by this function and have group_count entries */
+static int mvl_aggregate_groups_acc(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 group_count, LIBMVL_VECTOR *vec, int aggregate, int integer, 
+				    MVL_AGGREGATE_ACC **acc_out, LIBMVL_OFFSET64 **cnt_out)
+{
+LIBMVL_OFFSET64 t, g, nthreads;
+MVL_AGGREGATE_ACC *acc;
+LIBMVL_OFFSET64 *cnt;
+int err, e;
+
+nthreads=mvl_max_threads();
+if(count<LIBMVL_PARALLEL_AGGREGATE_THRESHOLD || nthreads*group_count>count)nthreads=1;
+
+acc=do_malloc(nthreads*group_count, sizeof(*acc));
+cnt=do_malloc(nthreads*group_count, sizeof(*cnt));
+
+err=0;
+MVL_OMP(omp parallel for private(e) schedule(static) if(nthreads>1))
+for(t=0;t<nthreads;t++) {
+	mvl_aggregate_init(group_count, aggregate, integer, &(acc[t*group_count]), &(cnt[t*group_count]));
+	e=mvl_aggregate_range((count*t)/nthreads, (count*(t+1))/nthreads, indices, group_id, vec, aggregate, integer, &(acc[t*group_count]), &(cnt[t*group_count]));
+	if(e<0) {
+		MVL_OMP(omp critical)
+		err=e;
+		}
+	}
+
+if(err<0) {
+	free(acc);
+	free(cnt);
+	return(err);
+	}
+
+/* Combine partial results */
+MVL_OMP(omp parallel for private(t) schedule(static) if(nthreads>1))
+for(g=0;g<group_count;g++) {
+	for(t=1;t<nthreads;t++) {
+		cnt[g]+=cnt[t*group_count+g];
+		mvl_aggregate_combine(aggregate, integer, &(acc[g]), &(acc[t*group_count+g]));
+		}
+	}
+
+*acc_out=acc;
+*cnt_out=cnt;
+return(0);
+}
+
+/*! @brief Compute per-group aggregates of a numeric vector. Similar to aggregate functions used with GROUP BY clause in SQL.
+ * 
+ *  Row indices[i] belongs to group group_id[i]. Group ids can be obtained with mvl_hash_map_group_ids() after mvl_find_groups().
+ *  Integer values are aggregated exactly, with minima and maxima kept as 64-bit integers and sums accumulated in long double, and the results are then converted to double. 
+ *  Use mvl_write_aggregate_groups() to obtain exact minima and maxima of LIBMVL_VECTOR_INT64 values. 
+ *  Floating point values are aggregated as double. Sums and means propagate NaN values, while minimum and maximum ignore them. 
+ *  Empty groups have count and sum of 0, a mean of NaN, a minimum of +Inf and a maximum of -Inf. 
+ * 
+ *  Large inputs are processed by several threads when libMVL is compiled with OpenMP support. Each thread accumulates its own partial results, and these are combined at the end.
+ *  Because of different order of additions sums and means of floating point values can differ in the last bits depending on the number of threads.
+ * 
+ *  @param count number of entries in indices and group_id arrays
+ *  @param indices an array of row indices into vec
+ *  @param group_id an array of group ids, each less than group_count
+ *  @param group_count the number of groups
+ *  @param vec a LIBMVL_VECTOR of type LIBMVL_VECTOR_UINT8, LIBMVL_VECTOR_INT32, LIBMVL_VECTOR_INT64, LIBMVL_VECTOR_FLOAT or LIBMVL_VECTOR_DOUBLE. It can be NULL for LIBMVL_AGGREGATE_COUNT. 
+ *             LIBMVL_VECTOR_OFFSET64 vectors hold offsets and indices and are rejected with LIBMVL_ERR_UNKNOWN_TYPE
+ *  @param aggregate one of LIBMVL_AGGREGATE_COUNT, LIBMVL_AGGREGATE_SUM, LIBMVL_AGGREGATE_MIN, LIBMVL_AGGREGATE_MAX or LIBMVL_AGGREGATE_MEAN
+ *  @param result an array of length group_count for the results
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_aggregate_groups(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 group_count, LIBMVL_VECTOR *vec, int aggregate, double *result)
+{
+MVL_AGGREGATE_ACC *acc;
+LIBMVL_OFFSET64 *cnt;
+int integer, err;
+
+if(aggregate<LIBMVL_AGGREGATE_COUNT || aggregate>LIBMVL_AGGREGATE_MEAN)return(LIBMVL_ERR_INVALID_PARAMETER);
+if((integer=mvl_aggregate_integer(vec, aggregate))<0)return(integer);
+if(group_count<1)return(0);
+
+if((err=mvl_aggregate_groups_acc(count, indices, group_id, group_count, vec, aggregate, integer, &acc, &cnt))<0)return(err);
+
+mvl_aggregate_finish(group_count, aggregate, integer, acc, cnt, result);
+free(acc);
+free(cnt);
+return(0);
+}
+
+/*! @brief Compute per-group aggregates of a numeric vector for groups given by a partition, such as produced by mvl_find_groups_sorted()
+ * 
+ *  Group k consists of rows indices[groups->offset[k]] to indices[groups->offset[k+1]-1]. Since each group is contiguous, no partial results are needed and groups are processed in parallel.
+ *  Counts, minima and maxima are the same as with mvl_aggregate_groups(). Sums and means of floating point values can differ in the last bits, because the values are added in a different order.
+ * 
+ *  @param groups a LIBMVL_PARTITION describing groups, there are groups->count-1 of them
+ *  @param indices an array of row indices into vec
+ *  @param vec a LIBMVL_VECTOR of the same types as accepted by mvl_aggregate_groups(), it can be NULL for LIBMVL_AGGREGATE_COUNT
+ *  @param aggregate one of LIBMVL_AGGREGATE_COUNT, LIBMVL_AGGREGATE_SUM, LIBMVL_AGGREGATE_MIN, LIBMVL_AGGREGATE_MAX or LIBMVL_AGGREGATE_MEAN
+ *  @param result an array of length groups->count-1 for the results
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_aggregate_partition(LIBMVL_PARTITION *groups, const LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, int aggregate, double *result)
+{
+LIBMVL_OFFSET64 g, i, j, n, group_count, cnt;
+double values[LIBMVL_AGGREGATE_BLOCK];
+long long ivalues[LIBMVL_AGGREGATE_BLOCK];
+MVL_AGGREGATE_ACC a;
+int integer;
+
+if(aggregate<LIBMVL_AGGREGATE_COUNT || aggregate>LIBMVL_AGGREGATE_MEAN)return(LIBMVL_ERR_INVALID_PARAMETER);
+if((integer=mvl_aggregate_integer(vec, aggregate))<0)return(integer);
+if(groups->count<2)return(0);
+group_count=groups->count-1;
+
+if(aggregate==LIBMVL_AGGREGATE_COUNT) {
+	for(g=0;g<group_count;g++)result[g]=groups->offset[g+1]-groups->offset[g];
+	return(0);
+	}
+
+MVL_OMP(omp parallel for private(i, j, n, cnt, a, values, ivalues) schedule(dynamic, 256) if(groups->offset[group_count]>=LIBMVL_PARALLEL_AGGREGATE_THRESHOLD))
+for(g=0;g<group_count;g++) {
+	mvl_aggregate_init(1, aggregate, integer, &a, &cnt);
+	for(i=groups->offset[g];i<groups->offset[g+1];i+=n) {
+		n=groups->offset[g+1]-i;
+		if(n>LIBMVL_AGGREGATE_BLOCK)n=LIBMVL_AGGREGATE_BLOCK;
+		if(integer) {
+			mvl_aggregate_gather_int(n, &(indices[i]), vec, ivalues);
+			switch(aggregate) {
+				case LIBMVL_AGGREGATE_MIN:
+					for(j=0;j<n;j++)
+						if(ivalues[j]<a.i)a.i=ivalues[j];
+					break;
+				case LIBMVL_AGGREGATE_MAX:
+					for(j=0;j<n;j++)
+						if(ivalues[j]>a.i)a.i=ivalues[j];
+					break;
+				default:
+					for(j=0;j<n;j++)a.s+=ivalues[j];
+				}
 			} else {
-			hm->first[group_count]=tmp[l-1];
-			group_count++;
-			memmove(tmp, &(tmp[l]), (j-l)*sizeof(*tmp));
-			hm->first[i]=tmp[0];
-			hm->next[tmp[0]]=~0LLU;
-			j-=l;
+			mvl_aggregate_gather_double(n, &(indices[i]), vec, values);
+			switch(aggregate) {
+				case LIBMVL_AGGREGATE_MIN:
+					for(j=0;j<n;j++)
+						if(values[j]<a.d)a.d=values[j];
+					break;
+				case LIBMVL_AGGREGATE_MAX:
+					for(j=0;j<n;j++)
+						if(values[j]>a.d)a.d=values[j];
+					break;
+				default:
+					for(j=0;j<n;j++)a.d+=values[j];
+				}
 			}
+		cnt+=n;
 		}
+	mvl_aggregate_finish(1, aggregate, integer, &a, &cnt, &(result[g]));
+	}
+return(0);
+}
+
+/*! @brief Compute per-group aggregates with mvl_aggregate_groups() and write them to MVL file
+ * 
+ *  Counts are written as LIBMVL_VECTOR_INT64. Minima and maxima of LIBMVL_VECTOR_INT64 values are written exactly as LIBMVL_VECTOR_INT64, with empty groups holding the largest (for minima) or the smallest (for maxima) 64-bit integer.
+ *  All other aggregates are written as LIBMVL_VECTOR_DOUBLE.
+ * 
+ *  @param ctx MVL context pointer that has been opened for writing
+ *  @param count number of entries in indices and group_id arrays
+ *  @param indices an array of row indices into vec
+ *  @param group_id an array of group ids, each less than group_count
+ *  @param group_count the number of groups
+ *  @param vec a LIBMVL_VECTOR of the same types as accepted by mvl_aggregate_groups(), it can be NULL for LIBMVL_AGGREGATE_COUNT
+ *  @param aggregate one of LIBMVL_AGGREGATE_COUNT, LIBMVL_AGGREGATE_SUM, LIBMVL_AGGREGATE_MIN, LIBMVL_AGGREGATE_MAX or LIBMVL_AGGREGATE_MEAN
+ *  @param metadata an optional offset to metadata, or LIBMVL_NO_METADATA
+ *  @return offset of the written vector, or LIBMVL_NULL_OFFSET on error
+ */
+LIBMVL_OFFSET64 mvl_write_aggregate_groups(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 group_count, LIBMVL_VECTOR *vec, int aggregate, LIBMVL_OFFSET64 metadata)
+{
+MVL_AGGREGATE_ACC *acc;
+LIBMVL_OFFSET64 *cnt;
+double *result;
+long long int *ivalues;
+LIBMVL_OFFSET64 g, offset;
+int integer, err;
+
+integer=mvl_aggregate_integer(vec, aggregate);
+if(aggregate<LIBMVL_AGGREGATE_COUNT || aggregate>LIBMVL_AGGREGATE_MEAN)integer=LIBMVL_ERR_INVALID_PARAMETER;
+if(integer<0) {
+	mvl_set_error(ctx, integer);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+if(group_count<1) {
+	return(mvl_write_vector(ctx, aggregate==LIBMVL_AGGREGATE_COUNT ? LIBMVL_VECTOR_INT64 : LIBMVL_VECTOR_DOUBLE, 0, NULL, metadata));
+	}
+
+if((err=mvl_aggregate_groups_acc(count, indices, group_id, group_count, vec, aggregate, integer, &acc, &cnt))<0) {
+	mvl_set_error(ctx, err);
+	return(LIBMVL_NULL_OFFSET);
+	}
+
+if(aggregate==LIBMVL_AGGREGATE_COUNT) {
+	offset=mvl_write_vector(ctx, LIBMVL_VECTOR_INT64, group_count, cnt, metadata);
+	} else
+if(integer && mvl_vector_type(vec)==LIBMVL_VECTOR_INT64 && (aggregate==LIBMVL_AGGREGATE_MIN || aggregate==LIBMVL_AGGREGATE_MAX)) {
+	ivalues=do_malloc(group_count, sizeof(*ivalues));
+	for(g=0;g<group_count;g++)ivalues[g]=acc[g].i;
+	offset=mvl_write_vector(ctx, LIBMVL_VECTOR_INT64, group_count, ivalues, metadata);
+	free(ivalues);
+	} else {
+	result=do_malloc(group_count, sizeof(*result));
+	mvl_aggregate_finish(group_count, aggregate, integer, acc, cnt, result);
+	offset=mvl_write_vector(ctx, LIBMVL_VECTOR_DOUBLE, group_count, result, metadata);
+	free(result);
+	}
+free(acc);
+free(cnt);
+return(offset);
+}
+
+/* Dense group ids are computed in blocks of LIBMVL_DENSE_GROUP_BLOCK rows. The table starts with LIBMVL_DENSE_GROUP_TABLE_SIZE slots and is kept at most half full */
+#ifndef LIBMVL_DENSE_GROUP_BLOCK
+#define LIBMVL_DENSE_GROUP_BLOCK	4096
+#endif
+
+#ifndef LIBMVL_DENSE_GROUP_TABLE_SIZE
+#define LIBMVL_DENSE_GROUP_TABLE_SIZE	1024
+#endif
+
+/* Double the table of (hash, group+1) pairs, re-inserting all entries */
+static LIBMVL_OFFSET64 *mvl_grow_dense_group_table(LIBMVL_OFFSET64 *table, LIBMVL_OFFSET64 *size)
+{
+LIBMVL_OFFSET64 *table2;
+LIBMVL_OFFSET64 i, k, mask;
+
+mask=2*(*size)-1;
+table2=do_malloc(4*(*size), sizeof(*table2));
+memset(table2, 0, 4*(*size)*sizeof(*table2));
+
+for(i=0;i<*size;i++) {
+	if(!table[2*i+1])continue;
+	k=table[2*i] & mask;
+	while(table2[2*k+1])k=(k+1) & mask;
+	table2[2*k]=table[2*i];
+	table2[2*k+1]=table[2*i+1];
+	}
+free(table);
+*size=2*(*size);
+return(table2);
+}
+
+/* Common implementation of mvl_dense_group_ids() and mvl_dense_group_ids32(), exactly one of group_id and group_id32 is not NULL */
+static int mvl_dense_group_ids_common(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+				      LIBMVL_OFFSET64 *group_id, unsigned int *group_id32, LIBMVL_OFFSET64 *group_count)
+{
+LIBMVL_OFFSET64 *hash, *table, *first;
+LIBMVL_OFFSET64 i, j, k, n, g, mask, table_size, first_size, count;
+MVL_SORT_INFO si;
+MVL_SORT_UNIT su, su2;
+int err;
+
+*group_count=0;
+if(indices_count<1)return(0);
+
+si.vec=vec;
+si.data=vec_data;
+si.data_length=vec_data_length;
+si.nvec=vec_count;
+
+su.info=&si;
+su2.info=&si;
+
+hash=do_malloc(LIBMVL_DENSE_GROUP_BLOCK, sizeof(*hash));
+table_size=LIBMVL_DENSE_GROUP_TABLE_SIZE;
+table=do_malloc(2*table_size, sizeof(*table));
+memset(table, 0, 2*table_size*sizeof(*table));
+/* Row index of the first row in each group */
+first_size=table_size>>1;
+first=do_malloc(first_size, sizeof(*first));
+
+count=0;
+for(i=0;i<indices_count;i+=LIBMVL_DENSE_GROUP_BLOCK) {
+	n=indices_count-i;
+	if(n>LIBMVL_DENSE_GROUP_BLOCK)n=LIBMVL_DENSE_GROUP_BLOCK;
 	
+	if((err=mvl_hash_indices(n, &(indices[i]), hash, vec_count, vec, vec_data, vec_data_length, LIBMVL_COMPLETE_HASH))<0) {
+		free(hash);
+		free(table);
+		free(first);
+		return(err);
+		}
+	
+	for(j=0;j<n;j++) {
+		if(((j & (LIBMVL_HASH_PROBE_WINDOW-1))==0)) {
+			mask=table_size-1;
+			for(k=j;(k<n) && (k<j+LIBMVL_HASH_PROBE_WINDOW);k++)MVL_PREFETCH(&(table[2*(hash[k] & mask)]));
+			}
+		/* Keep the table at most half full */
+		if(2*(count+1)>table_size) {
+			table=mvl_grow_dense_group_table(table, &table_size);
+			first=mvl_grow_offsets(first, count, &first_size, table_size>>1);
+			}
+		
+		mask=table_size-1;
+		su.index=indices[i+j];
+		k=hash[j] & mask;
+		while(1) {
+			g=table[2*k+1];
+			if(!g) {
+				/* New group */
+				g=count+1;
+				table[2*k]=hash[j];
+				table[2*k+1]=g;
+				first[count]=su.index;
+				count++;
+				break;
+				}
+			if(table[2*k]==hash[j]) {
+				su2.index=first[g-1];
+				if(mvl_equals(&su, &su2))break;
+				}
+			k=(k+1) & mask;
+			}
+		
+		if(group_id!=NULL)group_id[i+j]=g-1;
+			else group_id32[i+j]=g-1;
+		}
 	}
-hm->first_count=group_count;
+
+free(hash);
+free(table);
+free(first);
+*group_count=count;
+return(0);
+}
+
+/*! @brief Assign a dense group id to each row, so that identical rows receive the same id. This is a compact alternative to mvl_compute_hash_map() followed by mvl_find_groups() 
+ *  for when only group membership is needed.
+ * 
+ *  Groups are numbered from 0 to group_count-1 in the order of their first row. Rows are hashed in blocks while being inserted into an open addressing table, 
+ *  and rows with equal hashes are compared with mvl_equals(). Only the output array and memory proportional to the number of groups are needed.
+ *  The ids can be passed to mvl_aggregate_groups().
+ * 
+ *  @param indices_count the number of rows
+ *  @param indices an array of row indices
+ *  @param vec_count the number of vectors describing rows
+ *  @param vec an array of vectors of the same length
+ *  @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from
+ *  @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from
+ *  @param group_id an output array of length indices_count
+ *  @param group_count the number of distinct groups found
+ *  @return 0 if everything went well, otherwise a negative error code
+ */
+int mvl_dense_group_ids(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 *group_count)
+{
+return(mvl_dense_group_ids_common(indices_count, indices, vec_count, vec, vec_data, vec_data_length, group_id, NULL, group_count));
+}
+
+/*! @brief Same as mvl_dense_group_ids(), but produces 32-bit group ids, halving the size of the output array.
+ * 
+ *  @param indices_count the number of rows, at most 2^32-1
+ *  @param indices an array of row indices
+ *  @param vec_count the number of vectors describing rows
+ *  @param vec an array of vectors of the same length
+ *  @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from
+ *  @param vec_data_length an array of lengths of memory mapped areas those LIBMVL_VECTORs derive from
+ *  @param group_id an output array of length indices_count
+ *  @param group_count the number of distinct groups found
+ *  @return 0 if everything went well, otherwise a negative error code. LIBMVL_ERR_INVALID_PARAMETER is returned when indices_count exceeds 2^32-1, as group ids would not fit in 32 bits
+ */
+int mvl_dense_group_ids32(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			  unsigned int *group_id, LIBMVL_OFFSET64 *group_count)
+{
+/* Group ids are less than indices_count, so this guarantees they are not truncated */
+if(indices_count>0xFFFFFFFFLLU)return(LIBMVL_ERR_INVALID_PARAMETER);
+return(mvl_dense_group_ids_common(indices_count, indices, vec_count, vec, vec_data, vec_data_length, NULL, group_id, group_count));
 }
 
 
+/*! @brief Initialize an empty partition. Storage is allocated on first use and released with mvl_free_partition_arrays()
+ * 
+ *  @param el Partition structure
+ */
+void mvl_init_partition(LIBMVL_PARTITION *el)
+{
+el->size=0;
+el->count=0;
+el->offset=NULL;
+}
+
 /*! @brief Increase storage of previously allocated partition
  * 
  *  @param el Partition structure
@@ -3066,6 +5890,9 @@ if(ei->hash_map.flags & MVL_FLAG_OWN_HASH_MAP)
 if(ei->hash_map.flags & MVL_FLAG_OWN_VEC_TYPES)
 	free(ei->hash_map.vec_types);
 
+if(ei->hash_map.flags & MVL_FLAG_OWN_TAGS)
+	free(ei->hash_map.tags);
+
 ei->hash_map.flags=0;
 ei->hash_map.hash_size=0;
 ei->hash_map.hash_map_size=0;
@@ -131,6 +131,12 @@ typedef struct {
  */	
 #define LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64	1
 
+/*!
+ *  @def LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64
+ * 	Checksum algorithm that hashes whole 64-bit words in four interleaved lanes. It is several times faster than LIBMVL_CHECKSUM_ALGORITHM_INTERNAL1_HASH64
+ */	
+#define LIBMVL_CHECKSUM_ALGORITHM_INTERNAL2_HASH64	2
+
 
 /*!
  *  @def LIBMVL_FULL_CHECKSUMS_DIRECTORY_KEY
@@ -245,7 +251,23 @@ typedef struct {
 	long *next_item;
 	long *first_item;
 	LIBMVL_OFFSET64 hash_size;
+	
+	/* Tags of the first external_tags entries point into memory mapped data and are not owned by the list */
+	long external_tags;
 	} LIBMVL_NAMED_LIST;
+
+/*!
+ *  @def LIBMVL_NAMED_LIST_HASH_ATTRIBUTE
+ *  	Attribute holding hash table of a named list, so that it does not have to be recomputed when the list is read back
+ */
+#define LIBMVL_NAMED_LIST_HASH_ATTRIBUTE	"MVL_HASH"
+
+/*!
+ *  @def LIBMVL_NAMED_LIST_HASH_VERSION
+ *  	Identifies the hash function and seed used to build the table stored in LIBMVL_NAMED_LIST_HASH_ATTRIBUTE. It is the first element of the table, and tables with a different version are recomputed when read back. 
+ *  	This must be changed whenever mvl_accumulate_hash64() or MVL_SEED_HASH_VALUE change.
+ */
+#define LIBMVL_NAMED_LIST_HASH_VERSION	0x4d564831
 	
 	
 /*! @brief This structure describes MVL context - a collection of system data associated with a single MVL file. 
@@ -277,6 +299,39 @@ typedef struct {
 	int abort_on_error;
 	int flags;
 	
+	/* Write buffer, see mvl_set_write_buffer_size(). write_offset is the file offset of the next byte written */
+	unsigned char *write_buffer;
+	LIBMVL_OFFSET64 write_buffer_size;
+	LIBMVL_OFFSET64 write_buffer_used;
+	LIBMVL_OFFSET64 write_offset;
+	
+	/* Vectors of at least direct_write_threshold bytes bypass page cache, see mvl_set_direct_write_threshold() */
+	LIBMVL_OFFSET64 direct_write_threshold;
+	unsigned char *direct_write_buffer;
+	
+	/* Memory map created by mvl_open_mapped(), it is released by mvl_free_context() */
+	void *mapping;
+	LIBMVL_OFFSET64 mapping_length;
+	
+	/* Algorithm used by mvl_write_hash64_checksum_vector(), see mvl_set_checksum_algorithm() */
+	int checksum_algorithm;
+	
+	/* Bitmap of blocks that passed verification against full checksums, see mvl_set_lazy_verification() */
+	int lazy_verification;
+	LIBMVL_OFFSET64 *verified_blocks;
+	LIBMVL_OFFSET64 verified_blocks_length;
+	
+	/* Block hashes of data written so far, see mvl_start_streaming_checksums() */
+	LIBMVL_OFFSET64 stream_checksum_block_size;
+	LIBMVL_OFFSET64 stream_checksum_start;
+	int stream_checksum_algorithm;
+	int stream_checksums_invalid;
+	unsigned char *stream_block;
+	LIBMVL_OFFSET64 stream_block_used;
+	LIBMVL_OFFSET64 *stream_hashes;
+	LIBMVL_OFFSET64 stream_hashes_count;
+	LIBMVL_OFFSET64 stream_hashes_size;
+	
 	} LIBMVL_CONTEXT;
 	
 /*! \def MVL_CONTEXT_DATA
@@ -320,6 +375,9 @@ typedef struct {
 #define LIBMVL_ERR_NO_CHECKSUMS		-25
 #define LIBMVL_ERR_NO_DATA		-26
 #define LIBMVL_ERR_MVL_FILE_TOO_SHORT	-27
+#define LIBMVL_ERR_CANNOT_OPEN		-28
+#define LIBMVL_ERR_CANNOT_MAP		-29
+#define LIBMVL_ERR_CHECKSUMS_INVALIDATED	-30
 
 LIBMVL_CONTEXT *mvl_create_context(void);
 void mvl_free_context(LIBMVL_CONTEXT *ctx);
@@ -362,6 +420,26 @@ LIBMVL_OFFSET64 mvl_start_write_vector(LIBMVL_CONTEXT *ctx, int type, LIBMVL_OFF
 /* In particular this allows vectors to be built up in pieces, by calling mvl_start_write_vector first */
 void mvl_rewrite_vector(LIBMVL_CONTEXT *ctx, int type, LIBMVL_OFFSET64 base_offset, LIBMVL_OFFSET64 idx, long length, const void *data);
 
+/* Reserve space for several vectors to be filled later with mvl_pwrite_vector(), which is safe to call from multiple threads */
+int mvl_reserve_vectors(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const int *types, const LIBMVL_OFFSET64 *lengths, const LIBMVL_OFFSET64 *metadata, LIBMVL_OFFSET64 *offsets);
+int mvl_pwrite_vector(LIBMVL_CONTEXT *ctx, int type, LIBMVL_OFFSET64 base_offset, LIBMVL_OFFSET64 idx, LIBMVL_OFFSET64 length, const void *data);
+
+/*! @brief Writable memory map of vector data created by mvl_map_vector_for_write()
+ */
+typedef struct {
+	void *data;
+	LIBMVL_OFFSET64 length;
+	int type;
+	
+	void *mapping;
+	LIBMVL_OFFSET64 mapping_offset;
+	LIBMVL_OFFSET64 mapping_length;
+	} LIBMVL_VECTOR_MAP;
+
+int mvl_map_vector_for_write(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, LIBMVL_VECTOR_MAP *map);
+int mvl_sync_vector_map(LIBMVL_VECTOR_MAP *map, int wait);
+void mvl_unmap_vector(LIBMVL_VECTOR_MAP *map);
+
 
 LIBMVL_OFFSET64 mvl_write_concat_vectors(LIBMVL_CONTEXT *ctx, int type, long nvec, const long *lengths, void **data, LIBMVL_OFFSET64 metadata);
 
@@ -386,6 +464,13 @@ LIBMVL_OFFSET64 mvl_write_packed_list(LIBMVL_CONTEXT *ctx, long count, const lon
 
 /* Compute and write checksum vector */
 LIBMVL_OFFSET64 mvl_write_hash64_checksum_vector(LIBMVL_CONTEXT *ctx, void *base, LIBMVL_OFFSET64 checksum_area_start, LIBMVL_OFFSET64 checksum_area_stop, LIBMVL_OFFSET64 checksum_block_size);
+int mvl_set_checksum_algorithm(LIBMVL_CONTEXT *ctx, int checksum_algorithm);
+void mvl_set_lazy_verification(LIBMVL_CONTEXT *ctx, int enable);
+/* Write checksum vector covering a larger area, reusing hashes of unchanged blocks */
+LIBMVL_OFFSET64 mvl_extend_checksum_vector(LIBMVL_CONTEXT *ctx, const LIBMVL_VECTOR *checksum_vector, void *data, LIBMVL_OFFSET64 checksum_area_stop);
+/* Compute checksums of data as it is written */
+int mvl_start_streaming_checksums(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 checksum_block_size);
+LIBMVL_OFFSET64 mvl_write_streaming_checksum_vector(LIBMVL_CONTEXT *ctx);
 
 /* Verify checksum for a given mapped area, could be just a portion of LIBMVL_VECTOR */
 int mvl_verify_checksum_vector(LIBMVL_CONTEXT *ctx, const LIBMVL_VECTOR *checksum_vector, void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop);
@@ -421,9 +506,10 @@ void mvl_free_named_list(LIBMVL_NAMED_LIST *L);
 
 /* By default named lists are created by mvl_create_named_list() without a hash table, to make adding elements faster 
  * Calling this function creates the hash table. 
- * Note that functions reading lists from MVL files create hash table automatically.
+ * Note that lists read from MVL files use a stored hash table when present, otherwise it is computed when the list is read, so lookups do not modify the list.
  */
 void mvl_recompute_named_list_hash(LIBMVL_NAMED_LIST *L);
+void mvl_named_list_copy_tags(LIBMVL_NAMED_LIST *L);
 
 long mvl_add_list_entry(LIBMVL_NAMED_LIST *L, long tag_length, const char *tag, LIBMVL_OFFSET64 offset);
 LIBMVL_OFFSET64 mvl_find_list_entry(LIBMVL_NAMED_LIST *L, long tag_length, const char *tag);
@@ -431,6 +517,8 @@ LIBMVL_OFFSET64 mvl_write_attributes_list(LIBMVL_CONTEXT *ctx, LIBMVL_NAMED_LIST
 
 /* This is meant to operate on memory mapped (or in-memory) files */
 LIBMVL_NAMED_LIST *mvl_read_attributes_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 metadata_offset);
+/* Same as above, but tags point into data instead of being copied */
+LIBMVL_NAMED_LIST *mvl_read_attributes_list_view(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 metadata_offset);
 
 /* Convenience function that create a named list populated with necessary entries
  * It needs writable context to write attribute values */
@@ -456,9 +544,15 @@ LIBMVL_OFFSET64 mvl_write_named_list_as_data_frame(LIBMVL_CONTEXT *ctx, LIBMVL_N
 
 /* This is meant to operate on memory mapped (or in-memory) files */
 LIBMVL_NAMED_LIST *mvl_read_named_list(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 offset);
+/* Same as above, but tags point into data instead of being copied */
+LIBMVL_NAMED_LIST *mvl_read_named_list_view(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 data_size, LIBMVL_OFFSET64 offset);
 
 void mvl_open(LIBMVL_CONTEXT *ctx, FILE *f);
+int mvl_open_append(LIBMVL_CONTEXT *ctx, FILE *f);
 void mvl_close(LIBMVL_CONTEXT *ctx);
+void mvl_set_write_buffer_size(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 size);
+void mvl_flush_write_buffer(LIBMVL_CONTEXT *ctx);
+void mvl_set_direct_write_threshold(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 threshold);
 void mvl_write_preamble(LIBMVL_CONTEXT *ctx);
 void mvl_write_postamble(LIBMVL_CONTEXT *ctx);
 
@@ -846,6 +940,48 @@ LIBMVL_OFFSET64 mvl_find_directory_entry(LIBMVL_CONTEXT *ctx, const char *tag);
  */
 void mvl_load_image(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 length);
 
+/*! @brief Flags passed to mvl_open_mapped() that describe expected access pattern
+ *   @def LIBMVL_MAP_SEQUENTIAL
+ *   Data will be read sequentially, aggressive read-ahead is desirable
+ *   @def LIBMVL_MAP_RANDOM
+ *   Data will be accessed at random, read-ahead is wasteful
+ *   @def LIBMVL_MAP_WILLNEED
+ *   Start reading the entire file in the background
+ *   @def LIBMVL_MAP_POPULATE
+ *   Read the entire file before mvl_open_mapped() returns, where supported
+ *   @def LIBMVL_MAP_HUGEPAGES
+ *   Request transparent huge pages for the mapping, where supported
+ */
+#define LIBMVL_MAP_SEQUENTIAL	(1<<0)
+#define LIBMVL_MAP_RANDOM	(1<<1)
+#define LIBMVL_MAP_WILLNEED	(1<<2)
+#define LIBMVL_MAP_POPULATE	(1<<3)
+#define LIBMVL_MAP_HUGEPAGES	(1<<4)
+
+/*! @brief Advice passed to mvl_advise_vector()
+ *   @def LIBMVL_ADVISE_NORMAL
+ *   Default read-ahead
+ *   @def LIBMVL_ADVISE_SEQUENTIAL
+ *   Vector will be scanned sequentially
+ *   @def LIBMVL_ADVISE_RANDOM
+ *   Vector will be accessed at random
+ *   @def LIBMVL_ADVISE_WILLNEED
+ *   Start reading vector data in the background
+ *   @def LIBMVL_ADVISE_DONTNEED
+ *   Vector data will not be needed soon
+ */
+#define LIBMVL_ADVISE_NORMAL		0
+#define LIBMVL_ADVISE_SEQUENTIAL	1
+#define LIBMVL_ADVISE_RANDOM		2
+#define LIBMVL_ADVISE_WILLNEED		3
+#define LIBMVL_ADVISE_DONTNEED		4
+
+int mvl_open_mapped(LIBMVL_CONTEXT *ctx, const char *path, int flags);
+int mvl_advise_vector(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, int advice);
+int mvl_prefetch_vectors(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *offsets);
+int mvl_prefetch_list_entries(LIBMVL_CONTEXT *ctx, LIBMVL_NAMED_LIST *L, LIBMVL_OFFSET64 count, const char **names);
+int mvl_vector_residency(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 offset, double *fraction);
+
 /*! @def LIBMVL_SORT_LEXICOGRAPHIC
  *  Sort in ascending order
  *  @def LIBMVL_SORT_LEXICOGRAPHIC_DESC
@@ -854,6 +990,20 @@ void mvl_load_image(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 lengt
 #define LIBMVL_SORT_LEXICOGRAPHIC	1		/* Ascending */
 #define LIBMVL_SORT_LEXICOGRAPHIC_DESC	2		/* Descending */
 
+/*! @def LIBMVL_SORT_DIRECTION_MASK
+ *  Bits of sort_function that hold sort direction
+ *  @def LIBMVL_SORT_NA_FIRST
+ *  Flag to combine with sort direction: place missing values (NaNs and MVL_NA_STRING) before all other values
+ *  @def LIBMVL_SORT_NA_LAST
+ *  Flag to combine with sort direction: place missing values (NaNs and MVL_NA_STRING) after all other values
+ *  @def LIBMVL_SORT_STABLE
+ *  Flag to combine with sort direction: rows that compare equal keep the order they had in the indices array, instead of being ordered by index
+ */
+#define LIBMVL_SORT_DIRECTION_MASK	0x0f
+#define LIBMVL_SORT_NA_FIRST	0x10
+#define LIBMVL_SORT_NA_LAST	0x20
+#define LIBMVL_SORT_STABLE	0x40
+
 /*
  * This function sorts indices into a list of vectors so that the resulting permutation is ordered.
  * The vector should all be the same length N, except LIBMVL_PACKED_LIST64 which should N+1 - this provides the same number of elements.
@@ -872,10 +1022,24 @@ void mvl_load_image(LIBMVL_CONTEXT *ctx, const void *data, LIBMVL_OFFSET64 lengt
  * @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
  * @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
  * @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. This allows computing hash from vectors drawn from different MVL files
- * @param sort_function one of LIBMVL_SORT_LEXICOGRAPHIC or LIBMVL_SORT_LEXICOGRAPHIC_DESC to specify sort direction
+ * @param sort_function one of LIBMVL_SORT_LEXICOGRAPHIC or LIBMVL_SORT_LEXICOGRAPHIC_DESC to specify sort direction, optionally combined with LIBMVL_SORT_NA_FIRST or LIBMVL_SORT_NA_LAST, and LIBMVL_SORT_STABLE. 
+ *        Without NA flags NaNs are treated as greater than any other value, so they come last in ascending order and first in descending order.
  */
 int mvl_sort_indices(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function);
 
+/*! @brief Arrange indices so that the first k of them are the same as after a full sort by mvl_sort_indices(). This is faster than a full sort when k is small.
+ * 
+ * @param indices_count  total number of indices 
+ * @param indices an array of indices into provided vectors. On return the first k entries are sorted, and the rest are in unspecified order
+ * @param vec_count the number of LIBMVL_VECTORS considered as columns in a table
+ * @param vec an array of pointers to LIBMVL_VECTORS considered as columns in a table
+ * @param vec_data an array of pointers to memory mapped areas those LIBMVL_VECTORs derive from. 
+ * @param sort_function sort direction and flags, same as for mvl_sort_indices()
+ * @param k number of leading indices to sort
+ * @return 0 on success
+ */
+int mvl_sort_indices_topk(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function, LIBMVL_OFFSET64 k);
+
 
 /* Hash function */
 
@@ -1046,6 +1210,103 @@ for(i=0;i<count;i++) {
 return(x);
 }
 
+/* This allows to accumulate hash value from several sources. 
+ * Initial x values can be anything except 0.
+ * The accumulation is done in place and in parallel for 8 streams, count 64-bit integers for each stream.
+ * Each stream gets the same hash as from mvl_accumulate_int64_hash64(), but independent streams are interleaved to hide multiplication latency.
+ */
+static inline void mvl_accumulate_int64_hash64x8(LIBMVL_OFFSET64 *x, const long long int *data0, const long long int *data1, const long long int *data2, const long long int *data3, const long long int *data4, const long long int *data5, const long long int *data6, const long long int *data7, LIBMVL_OFFSET64 count)
+{
+LIBMVL_OFFSET64 i, x0, x1, x2, x3, x4, x5, x6, x7;
+long long int d0, d1, d2, d3, d4, d5, d6, d7;
+unsigned *d_ext0=(unsigned *)&d0, *d_ext1=(unsigned *)&d1, *d_ext2=(unsigned *)&d2, *d_ext3=(unsigned *)&d3;
+unsigned *d_ext4=(unsigned *)&d4, *d_ext5=(unsigned *)&d5, *d_ext6=(unsigned *)&d6, *d_ext7=(unsigned *)&d7;
+
+x0=x[0];
+x1=x[1];
+x2=x[2];
+x3=x[3];
+x4=x[4];
+x5=x[5];
+x6=x[6];
+x7=x[7];
+
+for(i=0;i<count;i++) {
+	#define STEP(k)  {\
+		d ## k=(data ## k)[i]; \
+		x ## k=( (x ## k) + (d_ext ## k)[0]); \
+		(x ## k)*=13397683724573242421LLU; \
+		(x ## k) ^= (x ## k)>>33; \
+		x ## k=( (x ## k) + (d_ext ## k)[1]); \
+		(x ## k)*=13397683724573242421LLU; \
+		(x ## k) ^= (x ## k)>>33; \
+		}
+	STEP(0)
+	STEP(1)
+	STEP(2)
+	STEP(3)
+	STEP(4)
+	STEP(5)
+	STEP(6)
+	STEP(7)
+	#undef STEP
+	}
+
+x[0]=x0;
+x[1]=x1;
+x[2]=x2;
+x[3]=x3;
+x[4]=x4;
+x[5]=x5;
+x[6]=x6;
+x[7]=x7;
+}
+
+/* This allows to accumulate hash value from several sources. 
+ * Initial x values can be anything except 0.
+ * Unlike mvl_accumulate_int64_hash64() each 64-bit integer is consumed in a single step. Consecutive integers go to four independent lanes that are folded into x at the end.
+ */
+static inline LIBMVL_OFFSET64 mvl_accumulate_int64_hash64w(LIBMVL_OFFSET64 x, const long long int *data, LIBMVL_OFFSET64 count)
+{
+LIBMVL_OFFSET64 i, x0, x1, x2, x3;
+
+x0=x;
+x1=x^0x5555555555555555LLU;
+x2=x^0xaaaaaaaaaaaaaaaaLLU;
+x3=~x;
+
+for(i=0;i+4<=count;i+=4) {
+	#define STEP(k)  {\
+		x ## k=( (x ## k) + (LIBMVL_OFFSET64)data[i+k]); \
+		(x ## k)*=13397683724573242421LLU; \
+		(x ## k) ^= (x ## k)>>33; \
+		}
+	STEP(0)
+	STEP(1)
+	STEP(2)
+	STEP(3)
+	#undef STEP
+	}
+
+for(;i<count;i++) {
+	x0=(x0 + (LIBMVL_OFFSET64)data[i]);
+	x0*=13397683724573242421LLU;
+	x0 ^= x0>>33;
+	}
+
+x0=(x0+x1);
+x0*=13397683724573242421LLU;
+x0 ^= x0>>33;
+x0=(x0+x2);
+x0*=13397683724573242421LLU;
+x0 ^= x0>>33;
+x0=(x0+x3);
+x0*=13397683724573242421LLU;
+x0 ^= x0>>33;
+
+return(x0);
+}
+
 /* This allows to accumulate hash value from several sources.
  * Initial x value can be anything except 0 
  * 
@@ -1155,12 +1416,27 @@ int mvl_hash_range(LIBMVL_OFFSET64 i0, LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 *hash
  *   HASH_MAP member first owns allocated memory
  * @def MVL_FLAG_OWN_NEXT
  *   HASH_MAP member next owns allocated memory
+ * @def MVL_FLAG_OWN_TAGS
+ *   HASH_MAP member tags owns allocated memory
+ * @def MVL_FLAG_OPEN_ADDRESSING
+ *   HASH_MAP uses open addressing layout, see mvl_allocate_hash_map_flags()
  */
 #define MVL_FLAG_OWN_HASH	(1<<0)
 #define MVL_FLAG_OWN_HASH_MAP	(1<<1)
 #define MVL_FLAG_OWN_FIRST	(1<<2)
 #define MVL_FLAG_OWN_NEXT	(1<<3)
 #define MVL_FLAG_OWN_VEC_TYPES	(1<<4)
+#define MVL_FLAG_OWN_TAGS	(1<<5)
+#define MVL_FLAG_OPEN_ADDRESSING	(1<<6)
+
+/*! @brief Parameters of open addressing HASH_MAP layout
+ *  @def LIBMVL_HASH_GROUP
+ *   Number of slots whose tags are compared at once
+ *  @def LIBMVL_HASH_SLOT_SIZE
+ *   Number of hash_map entries per slot
+ */
+#define LIBMVL_HASH_GROUP	16
+#define LIBMVL_HASH_SLOT_SIZE	2
 
 /*! @brief This structure is used for constructing associative maps and also for describing index groupings
  * 
@@ -1171,7 +1447,7 @@ typedef struct {
 	LIBMVL_OFFSET64 flags; //!< flags describing HASH_MAP state
 	LIBMVL_OFFSET64 hash_count; //!< Number of valid entries in hash, hash_count < hash_size and hash_count < hash_map_size
 	LIBMVL_OFFSET64 hash_size; //!< size of hash, first and next arrays
-	LIBMVL_OFFSET64 hash_map_size; //!<  size of hash_map array, should be power of 2
+	LIBMVL_OFFSET64 hash_map_size; //!<  size of hash_map array, should be power of 2. With MVL_FLAG_OPEN_ADDRESSING this is the number of slots, a multiple of LIBMVL_HASH_GROUP larger than hash_count, and hash_map has LIBMVL_HASH_SLOT_SIZE*hash_map_size entries
 	LIBMVL_OFFSET64 first_count;  //!< Number of valid entries in first array - this is populated by mvl_find_groups()
 	LIBMVL_OFFSET64 *hash;     //!<  Input hashes, used by mvl_compute_hash_map()
 	LIBMVL_OFFSET64 *hash_map; //!<  This is an associative table mapping hash & (hash_map_size-1) into indices in the "first" array
@@ -1179,12 +1455,15 @@ typedef struct {
 	LIBMVL_OFFSET64 *next; //!< array of next indices in each group. ~0LLU indicates end of group
 	LIBMVL_OFFSET64 vec_count;  //!< Number of vectors used to produce hashes
 	int *vec_types; //!< Types of vectors used to produce hashes
+	unsigned char *tags; //!< Tags of hash_map slots, only used with MVL_FLAG_OPEN_ADDRESSING
 	} HASH_MAP;
 
 /* Compute suggested hash map size */
 LIBMVL_OFFSET64 mvl_compute_hash_map_size(LIBMVL_OFFSET64 hash_count);
+LIBMVL_OFFSET64 mvl_compute_open_hash_map_size(LIBMVL_OFFSET64 hash_count);
 
 HASH_MAP *mvl_allocate_hash_map(LIBMVL_OFFSET64 max_index_count);
+HASH_MAP *mvl_allocate_hash_map_flags(LIBMVL_OFFSET64 max_index_count, LIBMVL_OFFSET64 flags);
 void mvl_free_hash_map(HASH_MAP *hash_map);
 
 /* This uses data from hm->hash[] array */
@@ -1210,6 +1489,19 @@ int mvl_find_matches(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *k
 			   LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm, 
 			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 pairs_size, LIBMVL_OFFSET64 *key_match_indices, LIBMVL_OFFSET64 *match_indices);
 
+/* This function combines mvl_hash_match_count() and mvl_find_matches(), using several threads when available.
+ * The arrays key_match_indices and match_indices are allocated by the function and should be freed with free()
+ */
+int mvl_hash_join(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *key_indices, LIBMVL_OFFSET64 key_vec_count, LIBMVL_VECTOR **key_vec, void **key_vec_data, LIBMVL_OFFSET64 *key_vec_data_length, LIBMVL_OFFSET64 *key_hash,
+			   LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm, 
+			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 *pairs_count, LIBMVL_OFFSET64 **key_match_indices, LIBMVL_OFFSET64 **match_indices);
+
+/* Same as mvl_hash_join(), but partitions both sets of rows on hash bits and joins each partition with a small hash map. Only hm->hash and hm->hash_count are used.
+ */
+int mvl_partitioned_hash_join(LIBMVL_OFFSET64 key_indices_count, const LIBMVL_OFFSET64 *key_indices, LIBMVL_OFFSET64 key_vec_count, LIBMVL_VECTOR **key_vec, void **key_vec_data, LIBMVL_OFFSET64 *key_vec_data_length, LIBMVL_OFFSET64 *key_hash,
+			   LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, HASH_MAP *hm, 
+			   LIBMVL_OFFSET64 *key_last, LIBMVL_OFFSET64 *pairs_count, LIBMVL_OFFSET64 **key_match_indices, LIBMVL_OFFSET64 **match_indices);
+
 /* This function transforms HASH_MAP into a list of groups. 
  * After calling hm->hash_map is invalid, but hm->first and hm->next describe exactly identical rows 
  */
@@ -1231,6 +1523,29 @@ void mvl_extend_partition(LIBMVL_PARTITION *el, LIBMVL_OFFSET64 nelem);
 void mvl_find_repeats(LIBMVL_PARTITION *partition, LIBMVL_OFFSET64 count, LIBMVL_VECTOR **vec, void **data, LIBMVL_OFFSET64 *data_length);
 void mvl_free_partition_arrays(LIBMVL_PARTITION *el);
 
+/* Find groups of identical rows by sorting hashes. Group k is given by group_indices[groups->offset[k]] to group_indices[groups->offset[k+1]-1]
+ */
+int mvl_find_groups_sorted(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *hash, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			   LIBMVL_OFFSET64 *group_indices, LIBMVL_PARTITION *groups);
+
+/*! @brief Aggregate functions computed by mvl_aggregate_groups() and mvl_aggregate_partition()
+ */
+#define LIBMVL_AGGREGATE_COUNT	1
+#define LIBMVL_AGGREGATE_SUM	2
+#define LIBMVL_AGGREGATE_MIN	3
+#define LIBMVL_AGGREGATE_MAX	4
+#define LIBMVL_AGGREGATE_MEAN	5
+
+void mvl_hash_map_group_ids(HASH_MAP *hm, LIBMVL_OFFSET64 *group_id);
+int mvl_aggregate_groups(LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 group_count, LIBMVL_VECTOR *vec, int aggregate, double *result);
+int mvl_aggregate_partition(LIBMVL_PARTITION *groups, const LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, int aggregate, double *result);
+LIBMVL_OFFSET64 mvl_write_aggregate_groups(LIBMVL_CONTEXT *ctx, LIBMVL_OFFSET64 count, const LIBMVL_OFFSET64 *indices, const LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 group_count, LIBMVL_VECTOR *vec, int aggregate, LIBMVL_OFFSET64 metadata);
+
+int mvl_dense_group_ids(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			LIBMVL_OFFSET64 *group_id, LIBMVL_OFFSET64 *group_count);
+int mvl_dense_group_ids32(LIBMVL_OFFSET64 indices_count, const LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, LIBMVL_OFFSET64 *vec_data_length, 
+			  unsigned int *group_id, LIBMVL_OFFSET64 *group_count);
+
 #ifndef LIBMVL_EXTENT_INLINE_SIZE
 #define LIBMVL_EXTENT_INLINE_SIZE 4
 #endif
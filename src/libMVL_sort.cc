@@ -1,18 +1,354 @@
 #include <algorithm>
 #include <vector>
 #include <functional>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* OpenMP directives expand to nothing when compiling without OpenMP support */
+#ifdef _OPENMP
+#define MVL_OMP(...)	_Pragma(#__VA_ARGS__)
+#else
+#define MVL_OMP(...)
+#endif
 #include "pdqsort.h"
 #include "pdqidxsort.h"
 
 #define MVL_STATIC_MEMBERS 1
 #include "libMVL.h"
 
+/* Ranges with at least this many elements are sorted with a parallel sample sort, when libMVL is compiled with OpenMP support. 
+ * The same value is used to decide whether to process tie ranges in parallel.
+ */
+#ifndef LIBMVL_PARALLEL_SORT_THRESHOLD
+#define LIBMVL_PARALLEL_SORT_THRESHOLD	(1LLU<<20)
+#endif
+
+/* Ranges with at least this many elements are sorted with LSD radix sort, smaller ranges use pdqidxsort_branchless() */
+#ifndef LIBMVL_RADIX_SORT_THRESHOLD
+#define LIBMVL_RADIX_SORT_THRESHOLD	(1LLU<<14)
+#endif
+
+/* Runs of packed list entries with equal 8-byte prefixes that have at least LIBMVL_PACKED_LIST_SPLIT_COUNT elements 
+ * are sorted on the next 8 bytes, up to LIBMVL_PACKED_LIST_MAX_PREFIX_DEPTH bytes into the strings. Other runs are sorted with direct comparisons.
+ */
+#ifndef LIBMVL_PACKED_LIST_SPLIT_COUNT
+#define LIBMVL_PACKED_LIST_SPLIT_COUNT	64
+#endif
+
+#ifndef LIBMVL_PACKED_LIST_MAX_PREFIX_DEPTH
+#define LIBMVL_PACKED_LIST_MAX_PREFIX_DEPTH	64
+#endif
+
+/* mvl_sort_indices_topk() uses heap selection when at least LIBMVL_TOPK_HEAP_RATIO*k indices are given, 
+ * otherwise it partitions with nth_element() and sorts the first k indices with mvl_sort_indices() 
+ */
+#ifndef LIBMVL_TOPK_HEAP_RATIO
+#define LIBMVL_TOPK_HEAP_RATIO	64
+#endif
+
+/* Radix sort passes scatter over the whole range, which gets expensive once it no longer fits in cache.
+ * Ranges up to LIBMVL_RADIX_CACHE_COUNT elements are radix sorted when at most 4 byte passes are needed, larger ranges when at most 2 are needed. 
+ */
+#ifndef LIBMVL_RADIX_CACHE_COUNT
+#define LIBMVL_RADIX_CACHE_COUNT	(1LLU<<19)
+#endif
+
+static inline int mvl_sort_max_threads(void)
+{
+#ifdef _OPENMP
+if(omp_in_parallel())return 1;
+return(omp_get_max_threads());
+#else
+return 1;
+#endif
+}
+
+/* Radix keys are unsigned integers that compare in the same order as the original values. 
+ * Negative zero is mapped to the same key as positive zero, as the two compare equal.
+ * NaNs have no place in this order, so to_key() reports failure and the caller falls back to comparison sort.
+ */
+template <class Numeric> struct mvl_radix_traits;
+
+template <> struct mvl_radix_traits<unsigned char> {
+	typedef unsigned char Key;
+	static inline bool to_key(unsigned char x, Key &k) { k=x; return true; }
+	static inline unsigned char from_key(Key k) { return k; }
+	};
+
+template <> struct mvl_radix_traits<int> {
+	typedef unsigned int Key;
+	static inline bool to_key(int x, Key &k) { k=((Key)x) ^ 0x80000000U; return true; }
+	static inline int from_key(Key k) { return (int)(k ^ 0x80000000U); }
+	};
+
+template <> struct mvl_radix_traits<long long int> {
+	typedef LIBMVL_OFFSET64 Key;
+	static inline bool to_key(long long int x, Key &k) { k=((Key)x) ^ (1LLU<<63); return true; }
+	static inline long long int from_key(Key k) { return (long long int)(k ^ (1LLU<<63)); }
+	};
+
+template <> struct mvl_radix_traits<LIBMVL_OFFSET64> {
+	typedef LIBMVL_OFFSET64 Key;
+	static inline bool to_key(LIBMVL_OFFSET64 x, Key &k) { k=x; return true; }
+	static inline LIBMVL_OFFSET64 from_key(Key k) { return k; }
+	};
+
+template <> struct mvl_radix_traits<float> {
+	typedef unsigned int Key;
+	static inline bool to_key(float x, Key &k) { 
+		if(x!=x)return false;
+		if(x==0)x=0;
+		memcpy(&k, &x, sizeof(k));
+		k=(k & 0x80000000U) ? ~k : (k | 0x80000000U);
+		return true;
+		}
+	static inline float from_key(Key k) {
+		float x;
+		k=(k & 0x80000000U) ? (k & 0x7fffffffU) : ~k;
+		memcpy(&x, &k, sizeof(x));
+		return x;
+		}
+	};
+
+template <> struct mvl_radix_traits<double> {
+	typedef LIBMVL_OFFSET64 Key;
+	static inline bool to_key(double x, Key &k) { 
+		if(x!=x)return false;
+		if(x==0)x=0;
+		memcpy(&k, &x, sizeof(k));
+		k=(k & (1LLU<<63)) ? ~k : (k | (1LLU<<63));
+		return true;
+		}
+	static inline double from_key(Key k) {
+		double x;
+		k=(k & (1LLU<<63)) ? (k & ~(1LLU<<63)) : ~k;
+		memcpy(&x, &k, sizeof(x));
+		return x;
+		}
+	};
+
+/* LSD radix sort of data[] with indices[] moved alongside, one byte per pass. 
+ * Passes where all keys share the same byte are skipped, which is common for data with small range of values.
+ * Each pass moves every element, so when too many passes are needed comparison sort is faster and radix sort is not attempted.
+ * 
+ * On success data[] is sorted in ascending (or descending) order and 0 is returned. 
+ * Returns -1 if the data should not be radix sorted (NaNs are present, too many passes) or temporary memory could not be allocated. 
+ * In this case data and indices are unchanged.
+ */
+template <class Numeric>
+static int radix_sort_indices(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, Numeric *data, int descending)
+{
+typedef typename mvl_radix_traits<Numeric>::Key Key;
+const int nbytes=sizeof(Key);
+LIBMVL_OFFSET64 (*hist)[256];
+Key *keys, *keys2, *tmp_keys, *tmp_keys2;
+LIBMVL_OFFSET64 *idx, *idx2, *tmp_indices;
+Key k, k0, diff, flip;
+int npasses;
+
+flip=descending ? ~((Key)0) : 0;
+
+/* Bits that differ from the first key tell us which passes are needed */
+k=0;
+k0=0;
+diff=0;
+if(count>0 && !mvl_radix_traits<Numeric>::to_key(data[0], k0))return(-1);
+for(LIBMVL_OFFSET64 i=1;i<count;i++) {
+	if(!mvl_radix_traits<Numeric>::to_key(data[i], k))return(-1);
+	diff|=k ^ k0;
+	}
+
+npasses=0;
+for(int b=0;b<nbytes;b++)
+	if((diff>>(8*b)) & 0xff)npasses++;
+
+/* All keys are equal, nothing to do */
+if(npasses==0)return(0);
+if(npasses>(count<=LIBMVL_RADIX_CACHE_COUNT ? 4 : 2))return(-1);
+
+tmp_keys=(Key *)malloc(count*sizeof(*tmp_keys));
+tmp_keys2=(Key *)malloc(count*sizeof(*tmp_keys2));
+tmp_indices=(LIBMVL_OFFSET64 *)malloc(count*sizeof(*tmp_indices));
+hist=(LIBMVL_OFFSET64 (*)[256])calloc(nbytes, sizeof(*hist));
+if(tmp_keys==NULL || tmp_keys2==NULL || tmp_indices==NULL || hist==NULL) {
+	free(tmp_keys);
+	free(tmp_keys2);
+	free(tmp_indices);
+	free(hist);
+	return(-1);
+	}
+
+/* Keys are kept in their own buffers, data[] is only written with from_key() once sorting is done */
+keys=tmp_keys2;
+for(LIBMVL_OFFSET64 i=0;i<count;i++) {
+	mvl_radix_traits<Numeric>::to_key(data[i], k);
+	k^=flip;
+	keys[i]=k;
+	for(int b=0;b<nbytes;b++)
+		if((diff>>(8*b)) & 0xff)hist[b][(k>>(8*b)) & 0xff]++;
+	}
+
+idx=indices;
+keys2=tmp_keys;
+idx2=tmp_indices;
+
+for(int b=0;b<nbytes;b++) {
+	LIBMVL_OFFSET64 total, a;
+	int shift=8*b;
+	
+	if(!((diff>>shift) & 0xff))continue;
+	
+	total=0;
+	for(int j=0;j<256;j++) {
+		a=hist[b][j];
+		hist[b][j]=total;
+		total+=a;
+		}
+	
+	for(LIBMVL_OFFSET64 i=0;i<count;i++) {
+		LIBMVL_OFFSET64 m=hist[b][(keys[i]>>shift) & 0xff]++;
+		keys2[m]=keys[i];
+		idx2[m]=idx[i];
+		}
+	std::swap(keys, keys2);
+	std::swap(idx, idx2);
+	}
+	
+if(idx!=indices)memcpy(indices, idx, count*sizeof(*indices));
+
+for(LIBMVL_OFFSET64 i=0;i<count;i++)data[i]=mvl_radix_traits<Numeric>::from_key(keys[i] ^ flip);
+
+free(tmp_keys);
+free(tmp_keys2);
+free(tmp_indices);
+free(hist);
+return(0);
+}
+
+template <class Numeric, class Compare>
+static void sort_indices_range(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, Numeric *data, Compare comp, int descending)
+{
+if(count>=LIBMVL_RADIX_SORT_THRESHOLD && !radix_sort_indices(count, indices, data, descending))return;
+
+pdqidxsort_branchless(data, data+count, indices, comp);
+}
+
+/* Sample sort of data[] with indices[] moved alongside. 
+ * The range is split into buckets using splitters chosen from an evenly spaced sample, 
+ * elements are scattered into buckets and each bucket is sorted with sort_indices_range() by a separate thread.
+ * 
+ * Returns 0 on success and -1 if temporary memory could not be allocated, in which case data and indices are unchanged.
+ */
+template <class Numeric, class Compare>
+static int parallel_pdqidxsort(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, Numeric *data, int nthreads, Compare comp, int descending)
+{
+LIBMVL_OFFSET64 nbuckets, nsample, *bucket_start, *offsets;
+Numeric *tmp_data, *splitters;
+LIBMVL_OFFSET64 *tmp_indices;
+unsigned short *bucket;
+
+nbuckets=4*nthreads;
+if(nbuckets>65535)nbuckets=65535;
+nsample=32*nbuckets;
+if(nsample>count)return(-1);
+
+tmp_data=(Numeric *)malloc(count*sizeof(*tmp_data));
+tmp_indices=(LIBMVL_OFFSET64 *)malloc(count*sizeof(*tmp_indices));
+bucket=(unsigned short *)malloc(count*sizeof(*bucket));
+splitters=(Numeric *)malloc(nsample*sizeof(*splitters));
+offsets=(LIBMVL_OFFSET64 *)malloc(nthreads*nbuckets*sizeof(*offsets));
+bucket_start=(LIBMVL_OFFSET64 *)malloc((nbuckets+1)*sizeof(*bucket_start));
+
+if(tmp_data==NULL || tmp_indices==NULL || bucket==NULL || splitters==NULL || offsets==NULL || bucket_start==NULL) {
+	free(tmp_data);
+	free(tmp_indices);
+	free(bucket);
+	free(splitters);
+	free(offsets);
+	free(bucket_start);
+	return(-1);
+	}
+
+/* The sample is deterministic so that bucket boundaries do not change from run to run */
+for(LIBMVL_OFFSET64 i=0;i<nsample;i++)splitters[i]=data[(i*count)/nsample];
+std::sort(splitters, splitters+nsample, comp);
+for(LIBMVL_OFFSET64 i=1;i<nbuckets;i++)splitters[i-1]=splitters[(i*nsample)/nbuckets];
+
+MVL_OMP(omp parallel num_threads(nthreads))
+{
+#ifdef _OPENMP
+int t=omp_get_thread_num();
+int nt=omp_get_num_threads();
+#else
+int t=0;
+int nt=1;
+#endif
+LIBMVL_OFFSET64 i0=(count*t)/nt;
+LIBMVL_OFFSET64 i1=(count*(t+1))/nt;
+LIBMVL_OFFSET64 *ofs=&(offsets[t*nbuckets]);
+
+for(LIBMVL_OFFSET64 b=0;b<nbuckets;b++)ofs[b]=0;
+for(LIBMVL_OFFSET64 i=i0;i<i1;i++) {
+	LIBMVL_OFFSET64 b=std::upper_bound(splitters, splitters+nbuckets-1, data[i], comp)-splitters;
+	bucket[i]=b;
+	ofs[b]++;
+	}
+
+MVL_OMP(omp barrier)
+MVL_OMP(omp single)
+{
+LIBMVL_OFFSET64 total=0;
+for(LIBMVL_OFFSET64 b=0;b<nbuckets;b++) {
+	bucket_start[b]=total;
+	for(int k=0;k<nt;k++) {
+		LIBMVL_OFFSET64 a=offsets[k*nbuckets+b];
+		offsets[k*nbuckets+b]=total;
+		total+=a;
+		}
+	}
+bucket_start[nbuckets]=total;
+}
+
+for(LIBMVL_OFFSET64 i=i0;i<i1;i++) {
+	LIBMVL_OFFSET64 k=ofs[bucket[i]]++;
+	tmp_data[k]=data[i];
+	tmp_indices[k]=indices[i];
+	}
+
+MVL_OMP(omp barrier)
+MVL_OMP(omp for schedule(dynamic, 1))
+for(LIBMVL_OFFSET64 b=0;b<nbuckets;b++) {
+	LIBMVL_OFFSET64 start=bucket_start[b];
+	LIBMVL_OFFSET64 stop=bucket_start[b+1];
+	sort_indices_range(stop-start, tmp_indices+start, tmp_data+start, comp, descending);
+	std::copy(tmp_data+start, tmp_data+stop, data+start);
+	std::copy(tmp_indices+start, tmp_indices+stop, indices+start);
+	}
+}
+
+free(tmp_data);
+free(tmp_indices);
+free(bucket);
+free(splitters);
+free(offsets);
+free(bucket_start);
+return(0);
+}
 
 template <class Numeric> 
 static void sort_indices_asc(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, Numeric *data)
 {
+int nthreads;
+auto comp=[](Numeric a, Numeric b) { return (a<b);};
+
+if(count>=LIBMVL_PARALLEL_SORT_THRESHOLD && (nthreads=mvl_sort_max_threads())>1) {
+	if(!parallel_pdqidxsort(count, indices, data, nthreads, comp, 0))return;
+	}
 
-pdqidxsort_branchless(data, data+count, indices, [](Numeric a, Numeric b) { return (a<b);});
+sort_indices_range(count, indices, data, comp, 0);
 
 // for(int i=0;i<stop-start;i++) {
 // 	if(values[i]!=data[indices[i+start]])
@@ -28,8 +364,14 @@ pdqidxsort_branchless(data, data+count, indices, [](Numeric a, Numeric b) { retu
 template <class Numeric> 
 static void sort_indices_desc(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, Numeric *data)
 {
+int nthreads;
+auto comp=[](Numeric a, Numeric b) { return (a>b);};
+
+if(count>=LIBMVL_PARALLEL_SORT_THRESHOLD && (nthreads=mvl_sort_max_threads())>1) {
+	if(!parallel_pdqidxsort(count, indices, data, nthreads, comp, 1))return;
+	}
 
-pdqidxsort_branchless(data, data+count, indices, [](Numeric a, Numeric b) { return (a>b);});
+sort_indices_range(count, indices, data, comp, 1);
 
 // for(int i=0;i<stop-start;i++) {
 // 	if(values[i]!=data[indices[i+start]])
@@ -42,50 +384,12 @@ pdqidxsort_branchless(data, data+count, indices, [](Numeric a, Numeric b) { retu
 // 	}
 }
 
-static void sort_indices_packed_list64_asc(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data)
-{
-std::sort(indices+start, indices+stop, [vec, data](LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2) { 
-	LIBMVL_OFFSET64 al, bl, nn;
-	const unsigned char *ad, *bd;
-	al=mvl_packed_list_get_entry_bytelength(vec, i1);
-	bl=mvl_packed_list_get_entry_bytelength(vec, i2);
-	ad=mvl_packed_list_get_entry(vec, data, i1);
-	bd=mvl_packed_list_get_entry(vec, data, i2);
-	nn=al;
-	if(bl<nn)nn=bl;
-	for(LIBMVL_OFFSET64 j=0;j<nn;j++) {
-		if(ad[j]<bd[j])return true;
-		if(ad[j]>bd[j])return false;
-		}
-	return(al<bl);
-	});
-}
-
-static void sort_indices_packed_list64_desc(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data)
-{
-std::sort(indices+start, indices+stop, [vec, data](LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2) { 
-	LIBMVL_OFFSET64 al, bl, nn;
-	const unsigned char *ad, *bd;
-	al=mvl_packed_list_get_entry_bytelength(vec, i1);
-	bl=mvl_packed_list_get_entry_bytelength(vec, i2);
-	ad=mvl_packed_list_get_entry(vec, data, i1);
-	bd=mvl_packed_list_get_entry(vec, data, i2);
-	nn=al;
-	if(bl<nn)nn=bl;
-	for(LIBMVL_OFFSET64 j=0;j<nn;j++) {
-		if(ad[j]>bd[j])return true;
-		if(ad[j]<bd[j])return false;
-		}
-	return(al>bl);
-	});
-}
-
 template <class Numeric>
 void mvl_find_ties(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, Numeric *data, std::vector<std::pair<LIBMVL_OFFSET64, LIBMVL_OFFSET64>> &ties)
 {
 LIBMVL_OFFSET64 i,j;
 i=0;
-while(i<stop-start-1) {
+while(i+1<stop-start) {
 	if(data[i]!=data[i+1]) {
 		i++;
 		continue;
@@ -142,6 +446,233 @@ public:
 	}
 	};
 
+/* Packed list entries are sorted on 8-byte prefixes gathered into scratch space, 
+ * so most comparisons do not touch string data. The prefix holds 8 bytes starting at offset depth in big-endian order, padded with zeros, 
+ * and comparing prefixes as integers gives the same order as comparing these bytes of the strings.
+ */
+static inline LIBMVL_OFFSET64 mvl_packed64_prefix(LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 i, LIBMVL_OFFSET64 depth)
+{
+LIBMVL_OFFSET64 len, prefix;
+const unsigned char *d;
+len=mvl_packed_list_get_entry_bytelength(vec, i);
+if(len<=depth)return(0);
+len-=depth;
+if(len>8)len=8;
+d=mvl_packed_list_get_entry(vec, data, i)+depth;
+prefix=0;
+for(LIBMVL_OFFSET64 j=0;j<len;j++)prefix|=((LIBMVL_OFFSET64)d[j])<<(56-8*j);
+return(prefix);
+}
+
+/* Compare two entries whose first depth bytes (padded with zeros) are equal, the result is negative, zero or positive as with memcmp().
+ * If either entry is at most depth bytes long it is a prefix of the other one, so only the lengths matter.
+ */
+static inline int mvl_packed64_compare_tail(LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2, LIBMVL_OFFSET64 depth)
+{
+LIBMVL_OFFSET64 al, bl, nn;
+int c;
+al=mvl_packed_list_get_entry_bytelength(vec, i1);
+bl=mvl_packed_list_get_entry_bytelength(vec, i2);
+if(al>depth && bl>depth) {
+	nn=al;
+	if(bl<nn)nn=bl;
+	c=memcmp(mvl_packed_list_get_entry(vec, data, i1)+depth, mvl_packed_list_get_entry(vec, data, i2)+depth, nn-depth);
+	if(c)return(c);
+	}
+if(al<bl)return(-1);
+if(al>bl)return(1);
+return(0);
+}
+
+static void sort_packed64_tail(LIBMVL_OFFSET64 *first, LIBMVL_OFFSET64 *last, LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 depth, int descending)
+{
+if(descending)
+	pdqsort(first, last, [vec, data, depth](LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2) { return(mvl_packed64_compare_tail(vec, data, i1, i2, depth)>0); });
+	else
+	pdqsort(first, last, [vec, data, depth](LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2) { return(mvl_packed64_compare_tail(vec, data, i1, i2, depth)<0); });
+}
+
+/* Sort entries whose first depth bytes are equal on the next 8 bytes, refining runs of equal prefixes.
+ * Large runs are sorted on the following 8 bytes recursively, which helps with strings that share a long common prefix. 
+ * Past LIBMVL_PACKED_LIST_MAX_PREFIX_DEPTH, and for small runs, the remaining bytes are compared directly.
+ * On return d[] holds the prefixes at the given depth.
+ */
+static void sort_packed64_range(LIBMVL_OFFSET64 count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 *d, LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 depth, int descending)
+{
+LIBMVL_OFFSET64 i, j, k, prefix, depth2;
+LIBMVL_OFFSET64 *mid;
+
+for(i=0;i<count;i++)d[i]=mvl_packed64_prefix(vec, data, indices[i], depth);
+
+if(descending)
+	sort_indices_desc(count, indices, d);
+	else
+	sort_indices_asc(count, indices, d);
+
+depth2=depth+8;
+i=0;
+while(i+1<count) {
+	if(d[i]!=d[i+1]) {
+		i++;
+		continue;
+		}
+	for(j=i+2;(j<count) && d[j]==d[i];j++);
+	if(j-i<LIBMVL_PACKED_LIST_SPLIT_COUNT || depth2>=LIBMVL_PACKED_LIST_MAX_PREFIX_DEPTH) {
+		sort_packed64_tail(indices+i, indices+j, vec, data, depth2, descending);
+		} else {
+		/* Entries that end within the prefix are ordered by length alone, and precede longer entries */
+		mid=std::partition(indices+i, indices+j, [vec, depth2, descending](LIBMVL_OFFSET64 a) { return((mvl_packed_list_get_entry_bytelength(vec, a)<=depth2)!=(descending!=0)); });
+		prefix=d[i];
+		if(descending) {
+			sort_packed64_range(mid-indices-i, indices+i, d+i, vec, data, depth2, descending);
+			sort_packed64_tail(mid, indices+j, vec, data, depth2, descending);
+			} else {
+			sort_packed64_tail(indices+i, mid, vec, data, depth2, descending);
+			sort_packed64_range(indices+j-mid, mid, d+(mid-indices), vec, data, depth2, descending);
+			}
+		for(k=i;k<j;k++)d[k]=prefix;
+		}
+	i=j;
+	}
+}
+
+static void sort_indices_packed_list64(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data, mvl_scratch &scratch, int descending)
+{
+if(scratch.reserve((stop-start)*sizeof(LIBMVL_OFFSET64))<0)return;
+sort_packed64_range(stop-start, indices+start, (LIBMVL_OFFSET64 *)scratch.data(), vec, data, 0, descending);
+}
+
+/* Entries with equal prefixes are equal if the lengths and the bytes past the prefix match */
+static inline int mvl_packed64_equal_tail(LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2)
+{
+LIBMVL_OFFSET64 al, bl;
+al=mvl_packed_list_get_entry_bytelength(vec, i1);
+bl=mvl_packed_list_get_entry_bytelength(vec, i2);
+if(al!=bl)return 0;
+if(al<=8)return 1;
+return(!memcmp(mvl_packed_list_get_entry(vec, data, i1)+8, mvl_packed_list_get_entry(vec, data, i2)+8, al-8));
+}
+
+/* Missing values are NaNs in floating point vectors and MVL_NA_STRING entries in packed lists. Other types have no missing values. */
+static inline int mvl_indexed_is_na(LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 i)
+{
+switch(mvl_vector_type(vec)) {
+	case LIBMVL_VECTOR_FLOAT: {
+		float x=mvl_vector_data_float(vec)[i];
+		return(x!=x);
+		}
+	case LIBMVL_VECTOR_DOUBLE: {
+		double x=mvl_vector_data_double(vec)[i];
+		return(x!=x);
+		}
+	case LIBMVL_PACKED_LIST64:
+		return(mvl_packed_list_is_na(vec, data, i));
+	default:
+		return 0;
+	}
+}
+
+/* Move indices of missing values to the end (na_last!=0) or the start of the range in a single pass. 
+ * Returns the boundary between missing and other values. 
+ */
+static LIBMVL_OFFSET64 mvl_indexed_partition_na(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data, int na_last)
+{
+LIBMVL_OFFSET64 *mid;
+switch(mvl_vector_type(vec)) {
+	case LIBMVL_VECTOR_FLOAT:
+	case LIBMVL_VECTOR_DOUBLE:
+	case LIBMVL_PACKED_LIST64:
+		break;
+	default:
+		return(na_last ? stop : start);
+	}
+na_last=(na_last!=0);
+mid=std::partition(indices+start, indices+stop, [vec, data, na_last](LIBMVL_OFFSET64 i) { return(mvl_indexed_is_na(vec, data, i)!=na_last); });
+return(mid-indices);
+}
+
+/* Returns 0 if sort_function is a valid combination of sort direction and flags, and -1 otherwise */
+static int mvl_check_sort_function(int sort_function)
+{
+if(sort_function & ~(LIBMVL_SORT_DIRECTION_MASK | LIBMVL_SORT_NA_FIRST | LIBMVL_SORT_NA_LAST | LIBMVL_SORT_STABLE))return -1;
+if((sort_function & LIBMVL_SORT_NA_FIRST) && (sort_function & LIBMVL_SORT_NA_LAST))return -1;
+switch(sort_function & LIBMVL_SORT_DIRECTION_MASK) {
+	case LIBMVL_SORT_LEXICOGRAPHIC:
+	case LIBMVL_SORT_LEXICOGRAPHIC_DESC:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Three-way comparison used by mvl_sort_indices_topk(). 
+ * Without NA flags NaNs compare greater than all other values, which matches the order produced by mvl_sort_indices().
+ */
+template <class Numeric>
+static inline int mvl_compare_values(Numeric a, Numeric b)
+{
+if(a<b)return(-1);
+if(a>b)return(1);
+return(0);
+}
+
+template <class Numeric>
+static inline int mvl_compare_float_values(Numeric a, Numeric b)
+{
+if(a<b)return(-1);
+if(a>b)return(1);
+if(a==b)return(0);
+if(a!=a)return(b!=b ? 0 : 1);
+return(-1);
+}
+
+/* sign is 1 for ascending and -1 for descending order. 
+ * na_order is -1 to place missing values first, 1 to place them last, and 0 to compare them as ordinary values. 
+ */
+static int mvl_compare_rows(LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sign, int na_order)
+{
+int c, na1, na2;
+for(LIBMVL_OFFSET64 k=0;k<vec_count;k++) {
+	LIBMVL_VECTOR *v=vec[k];
+	if(na_order) {
+		na1=mvl_indexed_is_na(v, vec_data[k], i1);
+		na2=mvl_indexed_is_na(v, vec_data[k], i2);
+		if(na1 && na2)continue;
+		if(na1)return(na_order);
+		if(na2)return(-na_order);
+		}
+	switch(mvl_vector_type(v)) {
+		case LIBMVL_VECTOR_UINT8:
+		case LIBMVL_VECTOR_CSTRING:
+			c=mvl_compare_values(mvl_vector_data_uint8(v)[i1], mvl_vector_data_uint8(v)[i2]);
+			break;
+		case LIBMVL_VECTOR_INT32:
+			c=mvl_compare_values(mvl_vector_data_int32(v)[i1], mvl_vector_data_int32(v)[i2]);
+			break;
+		case LIBMVL_VECTOR_FLOAT:
+			c=mvl_compare_float_values(mvl_vector_data_float(v)[i1], mvl_vector_data_float(v)[i2]);
+			break;
+		case LIBMVL_VECTOR_INT64:
+			c=mvl_compare_values(mvl_vector_data_int64(v)[i1], mvl_vector_data_int64(v)[i2]);
+			break;
+		case LIBMVL_VECTOR_OFFSET64:
+			c=mvl_compare_values(mvl_vector_data_offset(v)[i1], mvl_vector_data_offset(v)[i2]);
+			break;
+		case LIBMVL_VECTOR_DOUBLE:
+			c=mvl_compare_float_values(mvl_vector_data_double(v)[i1], mvl_vector_data_double(v)[i2]);
+			break;
+		case LIBMVL_PACKED_LIST64:
+			c=mvl_packed64_compare_tail(v, vec_data[k], i1, i2, 0);
+			break;
+		default:
+			c=0;
+			break;
+		}
+	if(c)return(sign*c);
+	}
+return(0);
+}
+
 extern "C" {
 
 void mvl_indexed_sort_single_vector_asc(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data, mvl_scratch &scratch)
@@ -198,7 +729,7 @@ switch(mvl_vector_type(vec)) {
 		break;
 		}
 	case LIBMVL_PACKED_LIST64:
-		sort_indices_packed_list64_asc(start, stop, indices, vec, data);
+		sort_indices_packed_list64(start, stop, indices, vec, data, scratch, 0);
 		break;
 	default:
 		break;
@@ -259,7 +790,7 @@ switch(mvl_vector_type(vec)) {
 		break;
 		}
 	case LIBMVL_PACKED_LIST64:
-		sort_indices_packed_list64_desc(start, stop, indices, vec, data);
+		sort_indices_packed_list64(start, stop, indices, vec, data, scratch, 1);
 		break;
 	default:
 		break;
@@ -267,23 +798,6 @@ switch(mvl_vector_type(vec)) {
 }
 
 
-static inline int mvl_packed64_equal(LIBMVL_VECTOR *vec, void *data, LIBMVL_OFFSET64 i1, LIBMVL_OFFSET64 i2)
-{
-LIBMVL_OFFSET64 al, bl;
-const unsigned char *ad, *bd;
-al=mvl_packed_list_get_entry_bytelength(vec, i1);
-bl=mvl_packed_list_get_entry_bytelength(vec, i2);
-if(al!=bl) {
-	return 0;
-	}
-ad=mvl_packed_list_get_entry(vec, data, i1);
-bd=mvl_packed_list_get_entry(vec, data, i2);
-for(LIBMVL_OFFSET64 k=0;k<al;k++) {
-	if(ad[k]!=bd[k])return 0;
-	}
-return 1;
-}
-
 void mvl_indexed_find_ties(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data, mvl_scratch &scratch, std::vector<std::pair<LIBMVL_OFFSET64, LIBMVL_OFFSET64>> &ties)
 {
 if(scratch.error()<0)return;
@@ -320,80 +834,249 @@ switch(mvl_vector_type(vec)) {
 		mvl_find_ties(start, stop, d, ties);
 		break;
 		}
-	case LIBMVL_PACKED_LIST64:
+	case LIBMVL_PACKED_LIST64: {
+		/* Scratch space holds sorted prefixes, string data is only examined when prefixes match */
+		LIBMVL_OFFSET64 *d=(LIBMVL_OFFSET64 *)scratch.data();
 		LIBMVL_OFFSET64 i,j;
-		i=start;
-		while(i<stop-1) {
-			if(!mvl_packed64_equal(vec, data, indices[i], indices[i+1])) {
+		i=0;
+		while(i+1<stop-start) {
+			if(d[i]!=d[i+1] || !mvl_packed64_equal_tail(vec, data, indices[i+start], indices[i+start+1])) {
 				i++;
 				continue;
 				}
 				
-			for(j=i+2;j<stop && mvl_packed64_equal(vec, data, indices[i], indices[j]);j++);
-			ties.push_back(std::make_pair(i, j));
+			for(j=i+2;(j<stop-start) && d[j]==d[i] && mvl_packed64_equal_tail(vec, data, indices[i+start], indices[j+start]);j++);
+			ties.push_back(std::make_pair(i+start, j+start));
 			i=j;
 			}
 		break;
+		}
 	default:
 		break;
 	}
 }
 
 
-/*
- * This function sorts indices into a list of vectors so that the resulting permutation is ordered.
- * The vector should all be the same length N, except LIBMVL_PACKED_LIST64 which should N+1 - this provides the same number of elements.
- * The indices are from 0 to N-1 and can repeat.
- * 
- * vec_data is the pointer to mapped data range where offsets point. This is needed only for vectors of type LIBMVL_PACKED_LIST64.
- * You can set vec_data to NULL if LIBMVL_PACKED_LIST64 vectors are not present. Also entries vec_data[i] can be NULL if the corresponding vector is not of type
- * LIBMVL_PACKED_LIST64
- * 
- * This function return 0 on successful sort. If no vectors are supplies (vec_count==0) the indices are unchanged the sort is considered successful
+/* Sort a range of indices on a single vector and append ranges of ties to ties vector.
+ * With NA flags missing values are first moved to one end of the range, where they form a single range of ties.
+ * Without NA flags NaNs are ordered after all other floating point values, the same as in mvl_compare_rows().
  */
-int mvl_sort_indices(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function)
+static void mvl_indexed_sort_range(LIBMVL_OFFSET64 start, LIBMVL_OFFSET64 stop, LIBMVL_OFFSET64 *indices, LIBMVL_VECTOR *vec, void *data, int sort_function, mvl_scratch &scratch, std::vector<std::pair<LIBMVL_OFFSET64, LIBMVL_OFFSET64>> &ties)
+{
+LIBMVL_OFFSET64 m;
+
+if(sort_function & LIBMVL_SORT_NA_LAST) {
+	m=mvl_indexed_partition_na(start, stop, indices, vec, data, 1);
+	if(stop-m>1)ties.push_back(std::make_pair(m, stop));
+	stop=m;
+	} else
+if(sort_function & LIBMVL_SORT_NA_FIRST) {
+	m=mvl_indexed_partition_na(start, stop, indices, vec, data, 0);
+	if(m-start>1)ties.push_back(std::make_pair(start, m));
+	start=m;
+	} else
+if(mvl_vector_type(vec)==LIBMVL_VECTOR_FLOAT || mvl_vector_type(vec)==LIBMVL_VECTOR_DOUBLE) {
+	if((sort_function & LIBMVL_SORT_DIRECTION_MASK)==LIBMVL_SORT_LEXICOGRAPHIC) {
+		m=mvl_indexed_partition_na(start, stop, indices, vec, data, 1);
+		if(stop-m>1)ties.push_back(std::make_pair(m, stop));
+		stop=m;
+		} else {
+		m=mvl_indexed_partition_na(start, stop, indices, vec, data, 0);
+		if(m-start>1)ties.push_back(std::make_pair(start, m));
+		start=m;
+		}
+	}
+
+if(stop-start<2)return;
+
+if((sort_function & LIBMVL_SORT_DIRECTION_MASK)==LIBMVL_SORT_LEXICOGRAPHIC)
+	mvl_indexed_sort_single_vector_asc(start, stop, indices, vec, data, scratch);
+	else
+	mvl_indexed_sort_single_vector_desc(start, stop, indices, vec, data, scratch);
+
+mvl_indexed_find_ties(start, stop, indices, vec, data, scratch, ties);
+}
+
+/* Leftover ties are sorted by index, or, if original indices are given, by position in the original array */
+static int mvl_sort_indices_ties(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function, const LIBMVL_OFFSET64 *orig)
 {
-if(vec_count<1)return 0;
 LIBMVL_OFFSET64 i, j;
+int err;
 
 mvl_scratch scratch;
 std::vector<std::pair<LIBMVL_OFFSET64, LIBMVL_OFFSET64>> ties1, ties2;
 
-
 ties1.clear();
 ties1.push_back(std::make_pair(0, indices_count));
-	
+
+err=0;
 for(i=0;i<vec_count;i++) {
 	ties2.clear();
-	for(j=0;j<ties1.size();j++) {
-		switch(sort_function) {
-			case LIBMVL_SORT_LEXICOGRAPHIC:
-				mvl_indexed_sort_single_vector_asc(ties1[j].first, ties1[j].second, indices, vec[i], vec_data[i], scratch);
-				break;
-			case LIBMVL_SORT_LEXICOGRAPHIC_DESC:
-				mvl_indexed_sort_single_vector_desc(ties1[j].first, ties1[j].second, indices, vec[i], vec_data[i], scratch);
-				break;
-			default:
-				return -1;
+	
+	if(ties1.size()<2 || indices_count<LIBMVL_PARALLEL_SORT_THRESHOLD || mvl_sort_max_threads()<2) {
+		/* A single large range (usually the first column) is sorted in parallel by mvl_indexed_sort_single_vector_*() */
+		for(j=0;j<ties1.size();j++) {
+			mvl_indexed_sort_range(ties1[j].first, ties1[j].second, indices, vec[i], vec_data[i], sort_function, scratch, ties2);
+			}
+		if(scratch.error()<0)err=scratch.error();
+		} else {
+		/* Tie ranges are independent, distribute them among threads. Each thread needs its own scratch space. */
+		MVL_OMP(omp parallel)
+		{
+		mvl_scratch local_scratch;
+		std::vector<std::pair<LIBMVL_OFFSET64, LIBMVL_OFFSET64>> local_ties;
+		
+		MVL_OMP(omp for schedule(dynamic, 16))
+		for(j=0;j<ties1.size();j++) {
+			mvl_indexed_sort_range(ties1[j].first, ties1[j].second, indices, vec[i], vec_data[i], sort_function, local_scratch, local_ties);
 			}
 		
-		mvl_indexed_find_ties(ties1[j].first, ties1[j].second, indices, vec[i], vec_data[i], scratch, ties2);
+		MVL_OMP(omp critical)
+		{
+		if(local_scratch.error()<0)err=local_scratch.error();
+		ties2.insert(ties2.end(), local_ties.begin(), local_ties.end());
+		}
+		}
 		}
+	if(err<0)return(err);
 	std::swap(ties1, ties2);
 	if(ties1.size()<1)break;
 	}
-if(scratch.error()<0)return(scratch.error());
-	
-if(ties1.size()>0) {
+
+if(ties1.size()<1)return 0;
+
+if(orig==NULL) {
 	/* Sort indices in ascending order for any remaining ties. 
 	 * This is important to improve locality of memory accesses */
 	
+	MVL_OMP(omp parallel for schedule(dynamic, 64) if(indices_count>=LIBMVL_PARALLEL_SORT_THRESHOLD && ties1.size()>1))
 	for(j=0;j<ties1.size();j++) {
 		pdqsort(indices+ties1[j].first, indices+ties1[j].second);
 		}
+	return 0;
 	}
 
+/* Stable sort: put remaining ties in the order they had in the original array.
+ * Positions are looked up in a sorted copy of the original indices. 
+ * All copies of a repeated index are in the same range of ties, and take consecutive slots of the sorted copy.
+ */
+LIBMVL_OFFSET64 *sorted, *pos;
+sorted=(LIBMVL_OFFSET64 *)malloc(indices_count*sizeof(*sorted));
+pos=(LIBMVL_OFFSET64 *)malloc(indices_count*sizeof(*pos));
+if(sorted==NULL || pos==NULL) {
+	free(sorted);
+	free(pos);
+	return -1;
+	}
+memcpy(sorted, orig, indices_count*sizeof(*sorted));
+for(i=0;i<indices_count;i++)pos[i]=i;
+sort_indices_asc(indices_count, pos, sorted);
+
+MVL_OMP(omp parallel for schedule(dynamic, 64) if(indices_count>=LIBMVL_PARALLEL_SORT_THRESHOLD && ties1.size()>1))
+for(j=0;j<ties1.size();j++) {
+	LIBMVL_OFFSET64 *first=indices+ties1[j].first;
+	LIBMVL_OFFSET64 *last=indices+ties1[j].second;
+	for(LIBMVL_OFFSET64 *p=first;p<last;p++)*p=std::lower_bound(sorted, sorted+indices_count, *p)-sorted;
+	pdqsort(first, last);
+	for(LIBMVL_OFFSET64 *p=first+1;p<last;p++)
+		if(*p<=p[-1])*p=p[-1]+1;
+	for(LIBMVL_OFFSET64 *p=first;p<last;p++)*p=pos[*p];
+	pdqsort(first, last);
+	for(LIBMVL_OFFSET64 *p=first;p<last;p++)*p=orig[*p];
+	}
+
+free(sorted);
+free(pos);
 return 0;
 }
 
+/*
+ * This function sorts indices into a list of vectors so that the resulting permutation is ordered.
+ * The vector should all be the same length N, except LIBMVL_PACKED_LIST64 which should N+1 - this provides the same number of elements.
+ * The indices are from 0 to N-1 and can repeat.
+ * 
+ * vec_data is the pointer to mapped data range where offsets point. This is needed only for vectors of type LIBMVL_PACKED_LIST64.
+ * You can set vec_data to NULL if LIBMVL_PACKED_LIST64 vectors are not present. Also entries vec_data[i] can be NULL if the corresponding vector is not of type
+ * LIBMVL_PACKED_LIST64
+ * 
+ * This function return 0 on successful sort. If no vectors are supplies (vec_count==0) the indices are unchanged the sort is considered successful
+ */
+int mvl_sort_indices(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function)
+{
+LIBMVL_OFFSET64 *orig;
+int err;
+
+if(vec_count<1)return 0;
+if(mvl_check_sort_function(sort_function)<0)return -1;
+
+if(!(sort_function & LIBMVL_SORT_STABLE) || indices_count<2)
+	return(mvl_sort_indices_ties(indices_count, indices, vec_count, vec, vec_data, sort_function, NULL));
+
+orig=(LIBMVL_OFFSET64 *)malloc(indices_count*sizeof(*orig));
+if(orig==NULL)return -1;
+memcpy(orig, indices, indices_count*sizeof(*orig));
+err=mvl_sort_indices_ties(indices_count, indices, vec_count, vec, vec_data, sort_function, orig);
+free(orig);
+return(err);
+}
+
+/*
+ * This function arranges indices so that the first k of them are the same as the first k after a call to mvl_sort_indices() with the same arguments.
+ * The remaining indices are left in unspecified order. 
+ * 
+ * This function returns 0 on success. If k is at least indices_count, this is the same as mvl_sort_indices().
+ */
+int mvl_sort_indices_topk(LIBMVL_OFFSET64 indices_count, LIBMVL_OFFSET64 *indices, LIBMVL_OFFSET64 vec_count, LIBMVL_VECTOR **vec, void **vec_data, int sort_function, LIBMVL_OFFSET64 k)
+{
+LIBMVL_OFFSET64 *orig, *pos;
+int sign, na_order, stable;
+
+if(vec_count<1)return 0;
+if(mvl_check_sort_function(sort_function)<0)return -1;
+
+if(k>=indices_count)return(mvl_sort_indices(indices_count, indices, vec_count, vec, vec_data, sort_function));
+if(k<1)return 0;
+
+sign=(sort_function & LIBMVL_SORT_DIRECTION_MASK)==LIBMVL_SORT_LEXICOGRAPHIC ? 1 : -1;
+na_order=0;
+if(sort_function & LIBMVL_SORT_NA_FIRST)na_order= -1;
+if(sort_function & LIBMVL_SORT_NA_LAST)na_order=1;
+stable=(sort_function & LIBMVL_SORT_STABLE)!=0;
+
+/* We select positions into the original array, so that stable sort can break ties by position */
+orig=(LIBMVL_OFFSET64 *)malloc(indices_count*sizeof(*orig));
+pos=(LIBMVL_OFFSET64 *)malloc(indices_count*sizeof(*pos));
+if(orig==NULL || pos==NULL) {
+	free(orig);
+	free(pos);
+	return -1;
+	}
+memcpy(orig, indices, indices_count*sizeof(*orig));
+for(LIBMVL_OFFSET64 i=0;i<indices_count;i++)pos[i]=i;
+
+/* Remaining ties are broken just like in mvl_sort_indices() */
+auto comp=[sign, na_order, stable, orig, vec_count, vec, vec_data](LIBMVL_OFFSET64 p1, LIBMVL_OFFSET64 p2) {
+	int c=mvl_compare_rows(orig[p1], orig[p2], vec_count, vec, vec_data, sign, na_order);
+	if(c)return(c<0);
+	if(!stable && orig[p1]!=orig[p2])return(orig[p1]<orig[p2]);
+	return(p1<p2);
+	};
+
+if(indices_count/LIBMVL_TOPK_HEAP_RATIO>=k) {
+	std::partial_sort(pos, pos+k, pos+indices_count, comp);
+	for(LIBMVL_OFFSET64 i=0;i<indices_count;i++)indices[i]=orig[pos[i]];
+	free(orig);
+	free(pos);
+	return 0;
+	}
+
+std::nth_element(pos, pos+k, pos+indices_count, comp);
+/* Restore original order of the first k positions for the stable sort */
+if(stable)pdqsort(pos, pos+k);
+for(LIBMVL_OFFSET64 i=0;i<indices_count;i++)indices[i]=orig[pos[i]];
+free(orig);
+free(pos);
+return(mvl_sort_indices(k, indices, vec_count, vec, vec_data, sort_function));
+}
+
 }